@@ -0,0 +1,164 @@
+/* ps2_ecc_sector against the byte-at-a-time encoder the 0x43 loop used to run - run by `make test` */
+
+#include "ps2/ps2_ecc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* the table of ps2_ecc.c, the reference goes through it one byte at a time */
+static const uint8_t EccTable[] = {
+	0x00, 0x87, 0x96, 0x11, 0xa5, 0x22, 0x33, 0xb4,0xb4, 0x33, 0x22, 0xa5, 0x11, 0x96, 0x87, 0x00,
+	0xc3, 0x44, 0x55, 0xd2, 0x66, 0xe1, 0xf0, 0x77,0x77, 0xf0, 0xe1, 0x66, 0xd2, 0x55, 0x44, 0xc3,
+	0xd2, 0x55, 0x44, 0xc3, 0x77, 0xf0, 0xe1, 0x66,0x66, 0xe1, 0xf0, 0x77, 0xc3, 0x44, 0x55, 0xd2,
+	0x11, 0x96, 0x87, 0x00, 0xb4, 0x33, 0x22, 0xa5,0xa5, 0x22, 0x33, 0xb4, 0x00, 0x87, 0x96, 0x11,
+	0xe1, 0x66, 0x77, 0xf0, 0x44, 0xc3, 0xd2, 0x55,0x55, 0xd2, 0xc3, 0x44, 0xf0, 0x77, 0x66, 0xe1,
+	0x22, 0xa5, 0xb4, 0x33, 0x87, 0x00, 0x11, 0x96,0x96, 0x11, 0x00, 0x87, 0x33, 0xb4, 0xa5, 0x22,
+	0x33, 0xb4, 0xa5, 0x22, 0x96, 0x11, 0x00, 0x87,0x87, 0x00, 0x11, 0x96, 0x22, 0xa5, 0xb4, 0x33,
+	0xf0, 0x77, 0x66, 0xe1, 0x55, 0xd2, 0xc3, 0x44,0x44, 0xc3, 0xd2, 0x55, 0xe1, 0x66, 0x77, 0xf0,
+	0xf0, 0x77, 0x66, 0xe1, 0x55, 0xd2, 0xc3, 0x44,0x44, 0xc3, 0xd2, 0x55, 0xe1, 0x66, 0x77, 0xf0,
+	0x33, 0xb4, 0xa5, 0x22, 0x96, 0x11, 0x00, 0x87,0x87, 0x00, 0x11, 0x96, 0x22, 0xa5, 0xb4, 0x33,
+	0x22, 0xa5, 0xb4, 0x33, 0x87, 0x00, 0x11, 0x96,0x96, 0x11, 0x00, 0x87, 0x33, 0xb4, 0xa5, 0x22,
+	0xe1, 0x66, 0x77, 0xf0, 0x44, 0xc3, 0xd2, 0x55,0x55, 0xd2, 0xc3, 0x44, 0xf0, 0x77, 0x66, 0xe1,
+	0x11, 0x96, 0x87, 0x00, 0xb4, 0x33, 0x22, 0xa5,0xa5, 0x22, 0x33, 0xb4, 0x00, 0x87, 0x96, 0x11,
+	0xd2, 0x55, 0x44, 0xc3, 0x77, 0xf0, 0xe1, 0x66,0x66, 0xe1, 0xf0, 0x77, 0xc3, 0x44, 0x55, 0xd2,
+	0xc3, 0x44, 0x55, 0xd2, 0x66, 0xe1, 0xf0, 0x77,0x77, 0xf0, 0xe1, 0x66, 0xd2, 0x55, 0x44, 0xc3,
+	0x00, 0x87, 0x96, 0x11, 0xa5, 0x22, 0x33, 0xb4,0xb4, 0x33, 0x22, 0xa5, 0x11, 0x96, 0x87, 0x00
+};
+
+/* what the 0x43 loop did while sending: bytes 0-511 plus the first spare byte, which by then is
+   already final and gets folded into the 4 bytes after the 12 ecc bytes */
+static void ecc_reference(uint8_t *buf) {
+    uint8_t *eccptr = &buf[512];
+    memset(eccptr, 0, 16);
+
+    for (uint32_t readptr = 0; readptr <= 512;) {
+        uint8_t c = EccTable[buf[readptr]];
+        eccptr[0] ^= c;
+        if (c & 0x80) {
+            eccptr[1] ^= ~(readptr & 0x7F);
+            eccptr[2] ^= (readptr & 0x7F);
+        }
+
+        ++readptr;
+
+        if ((readptr & 0x7F) == 0) {
+            eccptr[0] = ~eccptr[0] & 0x77;
+            eccptr[1] = ~eccptr[1] & 0x7F;
+            eccptr[2] = ~eccptr[2] & 0x7F;
+            eccptr += 3;
+        }
+    }
+}
+
+static int checked, failed;
+
+static void check(const uint8_t *data, const char *what) {
+    static uint32_t ref_words[528 / 4], new_words[528 / 4];
+    uint8_t *ref = (uint8_t *)ref_words, *got = (uint8_t *)new_words;
+
+    memcpy(ref, data, 512);
+    ecc_reference(ref);
+
+    memcpy(got, data, 512);
+    memset(&got[512], 0xA5, 16);
+    ps2_ecc_sector(got, &got[512]);
+
+    ++checked;
+    if (memcmp(&ref[512], &got[512], 16) != 0) {
+        if (failed++ < 10) {
+            printf("ecc mismatch, %s\n  expected", what);
+            for (int i = 512; i < 528; ++i)
+                printf(" %02X", ref[i]);
+            printf("\n  got     ");
+            for (int i = 512; i < 528; ++i)
+                printf(" %02X", got[i]);
+            printf("\n");
+        }
+    }
+}
+
+static uint32_t rng = 0x2545F491;
+
+static uint32_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+int main(void) {
+    uint8_t data[512];
+    char what[64];
+
+    memset(data, 0x00, sizeof(data));
+    check(data, "all 0x00");
+    memset(data, 0xFF, sizeof(data));
+    check(data, "all 0xFF");
+
+    for (int v = 0; v < 256; ++v) {
+        memset(data, v, sizeof(data));
+        snprintf(what, sizeof(what), "all 0x%02X", v);
+        check(data, what);
+    }
+
+    for (int i = 0; i < 512; ++i)
+        data[i] = (i & 1) ? 0xAA : 0x55;
+    check(data, "alternating 0x55/0xAA");
+    for (int i = 0; i < 512; ++i)
+        data[i] = (uint8_t)i;
+    check(data, "counting up");
+    for (int i = 0; i < 512; ++i)
+        data[i] = (uint8_t)(511 - i);
+    check(data, "counting down");
+
+    /* every single bit set in zeros and cleared in ones - each one hits a different column/line parity */
+    for (int bit = 0; bit < 512 * 8; ++bit) {
+        memset(data, 0x00, sizeof(data));
+        data[bit / 8] = (uint8_t)(1 << (bit % 8));
+        snprintf(what, sizeof(what), "bit %d set", bit);
+        check(data, what);
+
+        memset(data, 0xFF, sizeof(data));
+        data[bit / 8] = (uint8_t)~(1 << (bit % 8));
+        snprintf(what, sizeof(what), "bit %d cleared", bit);
+        check(data, what);
+    }
+
+    /* a single odd byte in every position, then in every pair of positions of one chunk */
+    for (int i = 0; i < 512; ++i) {
+        memset(data, 0xFF, sizeof(data));
+        data[i] = 0x7F;
+        snprintf(what, sizeof(what), "0x7F at %d", i);
+        check(data, what);
+    }
+    for (int i = 0; i < 128; ++i) {
+        for (int j = i + 1; j < 128; ++j) {
+            memset(data, 0x00, sizeof(data));
+            data[i] = 0x01;
+            data[j] = 0x80;
+            snprintf(what, sizeof(what), "bytes %d and %d", i, j);
+            check(data, what);
+        }
+    }
+
+    for (int n = 0; n < 100000; ++n) {
+        for (int i = 0; i < 512; i += 4) {
+            uint32_t w = xorshift();
+            memcpy(&data[i], &w, 4);
+        }
+        /* sparse sectors too, mostly 0xFF like a formatted card */
+        if (n & 1)
+            for (int i = 0; i < 512; ++i)
+                if (xorshift() & 7)
+                    data[i] = 0xFF;
+        snprintf(what, sizeof(what), "random sector %d", n);
+        check(data, what);
+    }
+
+    if (failed) {
+        printf("ecc_test: %d of %d sectors differ\n", failed, checked);
+        return 1;
+    }
+    printf("ecc_test: ok, %d sectors\n", checked);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * The psram chip and its qspi state machine on the host, in place of ps2_pio_qspi.c. A transfer
+ * takes as long as it would on the bus at the clock the driver set: the data moves right away,
+ * the done callback runs from host_idle once that time has passed, like the dma irq would. That
+ * also keeps the callback from running inside the call that started the transfer.
+ *
+ * The limits the scheduler promises are checked on every transfer: one transfer at a time,
+ * no write across a page and no burst that keeps CS low for longer than tCEM.
+ */
+
+#include "ps2_pio_qspi.h"
+
+#include "hardware/clocks.h"
+#include "hardware/sync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fake_qspi.h"
+
+#define CHIP_SIZE (8 * 1024 * 1024)
+#define PAGE_SIZE 1024
+#define TCEM_NS 8000
+
+pio_hw_t host_pio[2];
+
+static uint8_t chip[CHIP_SIZE];
+static float sm_clkdiv = 1.0f;
+
+static pio_qspi_dma_cb_t pending_cb;
+static uint64_t pending_done_ns;
+static int pending;
+
+static fake_qspi_stats_t stats;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void fail(const char *what, uint32_t addr, size_t len) {
+    fprintf(stderr, "fake qspi: %s at 0x%06X, %u bytes\n", what, (unsigned)addr, (unsigned)len);
+    abort();
+}
+
+void pio_sm_set_clkdiv(PIO pio, uint sm, float div) {
+    (void)pio;
+    (void)sm;
+    sm_clkdiv = div;
+}
+
+/* SCK is 4 PIO cycles, commands and data go 4 bits per clock */
+static uint64_t bus_ns(size_t srclen, uint wait, size_t datalen) {
+    double sck_hz = clock_get_hz(clk_sys) / 4.0 / sm_clkdiv;
+    return (uint64_t)((srclen * 2 + wait + datalen * 2) * 1e9 / sck_hz);
+}
+
+static uint32_t cmd_addr(const uint8_t *src) {
+    return ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | src[3];
+}
+
+static void start(const uint8_t *src, size_t srclen, uint wait, size_t datalen, pio_qspi_dma_cb_t done_cb) {
+    if (pending)
+        fail("transfer started while another one is on the bus", cmd_addr(src), datalen);
+
+    uint64_t ns = bus_ns(srclen, wait, datalen);
+    if (ns > TCEM_NS)
+        ++stats.tcem_violations;
+    if (ns > stats.max_burst_ns)
+        stats.max_burst_ns = ns;
+    stats.bus_ns += ns;
+    stats.bytes += datalen;
+    ++stats.transfers;
+
+    pending = 1;
+    pending_cb = done_cb;
+    pending_done_ns = now_ns() + ns;
+}
+
+void host_idle(void) {
+    if (!pending || now_ns() < pending_done_ns)
+        return;
+    pending = 0;
+    pio_qspi_dma_cb_t cb = pending_cb;
+    pending_cb = NULL;
+    if (cb)
+        cb();
+}
+
+void pio_spi_write8_read8_blocking(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen) {
+    (void)spi;
+    (void)srclen;
+    if (dstlen)
+        memset(dst, 0, dstlen);
+    /* read id: Known Good Die */
+    if (src[0] == 0x9F && dstlen >= 5) {
+        dst[3] = 0x0D;
+        dst[4] = 0x5D;
+    }
+}
+
+void pio_qspi_write8_read8_dma(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint wait, uint8_t *dst, size_t dstlen, pio_qspi_dma_cb_t done_cb) {
+    (void)spi;
+    uint32_t addr = cmd_addr(src);
+    if (src[0] != 0xEB || srclen != 4)
+        fail("unexpected read command", addr, dstlen);
+    /* reads carry on past the end of a page, the chip wraps at its size */
+    for (size_t i = 0; i < dstlen; ++i)
+        dst[i] = chip[(addr + i) % CHIP_SIZE];
+    start(src, srclen, wait, dstlen, done_cb);
+}
+
+static void write_check(const uint8_t *src, size_t srclen, size_t datalen) {
+    uint32_t addr = cmd_addr(src);
+    if (src[0] != 0x38 || srclen != 4)
+        fail("unexpected write command", addr, datalen);
+    if (addr / PAGE_SIZE != (addr + datalen - 1) / PAGE_SIZE)
+        fail("write across a page", addr, datalen);
+}
+
+void pio_qspi_write8_write_dma(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *data, size_t datalen, pio_qspi_dma_cb_t done_cb) {
+    (void)spi;
+    write_check(src, srclen, datalen);
+    memcpy(&chip[cmd_addr(src) % CHIP_SIZE], data, datalen);
+    start(src, srclen, 0, datalen, done_cb);
+}
+
+void pio_qspi_write8_fill_dma(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t fill, size_t filllen, pio_qspi_dma_cb_t done_cb) {
+    (void)spi;
+    write_check(src, srclen, filllen);
+    memset(&chip[cmd_addr(src) % CHIP_SIZE], fill, filllen);
+    start(src, srclen, 0, filllen, done_cb);
+}
+
+void pio_qspi_dma_init(const pio_spi_inst_t *spi) {
+    (void)spi;
+}
+
+void fake_qspi_get_stats(fake_qspi_stats_t *out) {
+    *out = stats;
+}
+
+void fake_qspi_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+/* one thread, so a lock only has to notice it's taken twice */
+static spin_lock_t locks[32];
+
+spin_lock_t *spin_lock_init(uint lock_num) {
+    locks[lock_num] = 0;
+    return &locks[lock_num];
+}
+
+uint spin_lock_claim_unused(bool required) {
+    (void)required;
+    return 0;
+}
+
+uint32_t spin_lock_blocking(spin_lock_t *lock) {
+    if (*lock) {
+        fprintf(stderr, "fake qspi: spin lock taken twice\n");
+        abort();
+    }
+    *lock = 1;
+    return 0;
+}
+
+void spin_unlock(spin_lock_t *lock, uint32_t saved_irq) {
+    (void)saved_irq;
+    *lock = 0;
+}
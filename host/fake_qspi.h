@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t transfers;
+    uint64_t bytes;
+    uint64_t bus_ns;          /* time the bus was busy by the clock model */
+    uint64_t max_burst_ns;    /* longest CS low time */
+    uint32_t tcem_violations; /* bursts longer than tCEM */
+} fake_qspi_stats_t;
+
+void fake_qspi_get_stats(fake_qspi_stats_t *stats);
+void fake_qspi_reset_stats(void);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "pico/platform.h"
+
+typedef volatile uint8_t io_rw_8;
+typedef volatile uint32_t io_rw_32;
+
+static inline void hw_set_bits(io_rw_32 *addr, uint32_t mask) {
+    *addr |= mask;
+}
+
+static inline void hw_clear_bits(io_rw_32 *addr, uint32_t mask) {
+    *addr &= ~mask;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "pico/platform.h"
+
+enum clock_index {
+    clk_sys = 5,
+};
+
+/* what the firmware sets clk_sys to */
+static inline uint32_t clock_get_hz(enum clock_index clk) {
+    (void)clk;
+    return 240 * 1000 * 1000;
+}
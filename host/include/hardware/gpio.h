@@ -0,0 +1,19 @@
+#pragma once
+
+#include "pico/platform.h"
+
+#define GPIO_OUT 1
+
+static inline void gpio_init(uint gpio) {
+    (void)gpio;
+}
+
+static inline void gpio_put(uint gpio, bool value) {
+    (void)gpio;
+    (void)value;
+}
+
+static inline void gpio_set_dir(uint gpio, bool out) {
+    (void)gpio;
+    (void)out;
+}
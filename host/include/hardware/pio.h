@@ -0,0 +1,43 @@
+#pragma once
+
+#include "hardware/address_mapped.h"
+#include "hardware/gpio.h"
+
+/* just the registers the ps2 code touches directly */
+typedef struct {
+    io_rw_32 txf[4];
+    io_rw_32 rxf[4];
+    io_rw_32 input_sync_bypass;
+} pio_hw_t;
+
+typedef pio_hw_t *PIO;
+
+extern pio_hw_t host_pio[2];
+#define pio0 (&host_pio[0])
+#define pio1 (&host_pio[1])
+
+typedef struct {
+    const uint16_t *instructions;
+    uint8_t length;
+    int8_t origin;
+} pio_program_t;
+
+static inline uint pio_add_program(PIO pio, const pio_program_t *program) {
+    (void)pio;
+    (void)program;
+    return 0;
+}
+
+static inline void pio_remove_program(PIO pio, const pio_program_t *program, uint offset) {
+    (void)pio;
+    (void)program;
+    (void)offset;
+}
+
+/* the fake backend times its transfers by the clock set here */
+void pio_sm_set_clkdiv(PIO pio, uint sm, float div);
+
+static inline void pio_sm_clkdiv_restart(PIO pio, uint sm) {
+    (void)pio;
+    (void)sm;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "pico/platform.h"
+
+/* one thread on the host, a lock that's taken twice is a bug in the caller */
+typedef volatile uint32_t spin_lock_t;
+
+spin_lock_t *spin_lock_init(uint lock_num);
+uint spin_lock_claim_unused(bool required);
+uint32_t spin_lock_blocking(spin_lock_t *lock);
+void spin_unlock(spin_lock_t *lock, uint32_t saved_irq);
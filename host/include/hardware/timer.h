@@ -0,0 +1,11 @@
+#pragma once
+
+#include "pico/platform.h"
+
+#include <time.h>
+
+static inline uint64_t time_us_64(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
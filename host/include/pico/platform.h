@@ -0,0 +1,24 @@
+#pragma once
+
+/* host stand-ins for the bits of the pico-sdk platform header the ps2 code uses */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+
+#define __time_critical_func(x) x
+#define __not_in_flash_func(x) x
+#define __no_inline_not_in_flash_func(x) x
+#define __unused __attribute__((unused))
+
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+#define __mem_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define __mem_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define __compiler_memory_barrier() __asm__ volatile("" ::: "memory")
+
+/* busy loops call this while they wait, the host runs whatever the hardware would have done meanwhile */
+void host_idle(void);
+#define tight_loop_contents() host_idle()
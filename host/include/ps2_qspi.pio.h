@@ -0,0 +1,22 @@
+#pragma once
+
+/* stands in for the header pioasm generates from ps2_qspi.pio, nothing runs the programs */
+
+#include "hardware/pio.h"
+
+static const pio_program_t spi_cpha0_program;
+static const pio_program_t qspi_cpha0_program;
+
+static inline void pio_spi_init(PIO pio, uint sm, uint prog_offs, uint n_bits,
+        float clkdiv, bool cpha, bool cpol, uint pin_sck, uint pin_mosi, uint pin_miso) {
+    (void)prog_offs; (void)n_bits; (void)cpha; (void)cpol;
+    (void)pin_sck; (void)pin_mosi; (void)pin_miso;
+    pio_sm_set_clkdiv(pio, sm, clkdiv);
+}
+
+static inline void pio_qspi_init(PIO pio, uint sm, uint prog_offs, uint n_bits,
+        float clkdiv, bool cpha, bool cpol, uint pin_sck, uint pin_dat) {
+    (void)prog_offs; (void)n_bits; (void)cpha; (void)cpol;
+    (void)pin_sck; (void)pin_dat;
+    pio_sm_set_clkdiv(pio, sm, clkdiv);
+}
@@ -0,0 +1,187 @@
+/*
+ * Replays SIO2 traces through the 0x81 transaction handlers and reports how long each command
+ * takes. A trace has one transaction per line, the bytes the console sends after 0x81 in hex;
+ * `xx*n` stands for n times xx, `#` starts a comment.
+ *
+ * The times are for the host cpu, not the RP2040 - they show whether a change to the handlers
+ * made a command slower or faster, next to the budget the console leaves per byte.
+ */
+
+#include "mc_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CARD_SIZE (8 * 1024 * 1024)
+#define MAX_XACT 4096
+#define MAX_BYTES 600
+
+/* the fastest clock clock_probe detects, each byte is 8 of them */
+#define BUDGET_KHZ 25000
+#define BUDGET_NS_PER_BYTE (8 * 1000000 / BUDGET_KHZ)
+#define SYS_MHZ 240
+
+typedef struct {
+    uint8_t *bytes;
+    uint16_t len;
+} xact_t;
+
+typedef struct {
+    uint64_t ns, min_ns, max_ns;
+    uint32_t count, bytes;
+} stat_t;
+
+static xact_t trace[MAX_XACT];
+static int trace_len;
+
+/* sub commands by themselves, 0xF0 split up by the MagicGate step */
+static stat_t stats[256 + 0x20];
+
+static int load_trace(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[4096];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = 0;
+
+        uint8_t bytes[MAX_BYTES];
+        int len = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            char *end;
+            unsigned long val = strtoul(tok, &end, 16);
+            unsigned long n = 1;
+            if (*end == '*')
+                n = strtoul(end + 1, &end, 10);
+            if (*end || val > 0xFF || len + n > MAX_BYTES) {
+                fprintf(stderr, "%s:%d: bad byte '%s'\n", path, lineno, tok);
+                fclose(f);
+                return -1;
+            }
+            while (n--)
+                bytes[len++] = (uint8_t)val;
+        }
+        if (!len)
+            continue;
+
+        if (trace_len == MAX_XACT) {
+            fprintf(stderr, "%s: more than %d transactions\n", path, MAX_XACT);
+            fclose(f);
+            return -1;
+        }
+        trace[trace_len].bytes = malloc(len);
+        memcpy(trace[trace_len].bytes, bytes, len);
+        trace[trace_len].len = (uint16_t)len;
+        ++trace_len;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int stat_index(const xact_t *x) {
+    if (x->bytes[0] == 0xF0 && x->len > 1 && x->bytes[1] < 0x20)
+        return 256 + x->bytes[1];
+    return x->bytes[0];
+}
+
+static void replay(int rounds) {
+    static uint8_t out[MAX_BYTES];
+
+    /* what a pair of clock reads costs by itself, taken off every sample */
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; ++i) {
+        uint64_t start = now_ns();
+        uint64_t ns = now_ns() - start;
+        if (ns < overhead)
+            overhead = ns;
+    }
+
+    memset(stats, 0, sizeof(stats));
+    for (int r = 0; r < rounds; ++r) {
+        mc_sim_init(CARD_SIZE);
+        for (int i = 0; i < trace_len; ++i) {
+            const xact_t *x = &trace[i];
+            uint64_t start = now_ns();
+            mc_sim_transaction(x->bytes, x->len, out, sizeof(out));
+            uint64_t ns = now_ns() - start;
+            ns = (ns > overhead) ? ns - overhead : 0;
+
+            stat_t *s = &stats[stat_index(x)];
+            s->ns += ns;
+            if (!s->count || ns < s->min_ns)
+                s->min_ns = ns;
+            if (ns > s->max_ns)
+                s->max_ns = ns;
+            ++s->count;
+            s->bytes += x->len + 1; /* and the 0x81 */
+        }
+    }
+}
+
+static void report(void) {
+    printf("budget at %d kHz: %d ns per byte, %d cycles at %d MHz\n\n",
+        BUDGET_KHZ, BUDGET_NS_PER_BYTE, BUDGET_NS_PER_BYTE * SYS_MHZ / 1000, SYS_MHZ);
+    /* the host gets preempted, min is the one to compare between builds - the mean and max carry the noise */
+    printf("cmd      count   ns/cmd   min ns   max ns  ns/byte\n");
+
+    uint64_t total_ns = 0, total_bytes = 0;
+    for (size_t i = 0; i < sizeof(stats) / sizeof(*stats); ++i) {
+        const stat_t *s = &stats[i];
+        if (!s->count)
+            continue;
+        if (i < 256)
+            printf("%02X    ", (unsigned)i);
+        else
+            printf("F0 %02X ", (unsigned)(i - 256));
+        printf("%8u %8.1f %8llu %8llu %8.2f\n", s->count, (double)s->ns / s->count,
+            (unsigned long long)s->min_ns, (unsigned long long)s->max_ns, (double)s->ns / s->bytes);
+        total_ns += s->ns;
+        total_bytes += s->bytes;
+    }
+    if (total_bytes)
+        printf("\nall %llu bytes: %.2f ns per byte\n", (unsigned long long)total_bytes,
+            (double)total_ns / total_bytes);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: mc_bench [-n rounds] trace...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 1000;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else
+            usage();
+    }
+    if (i == argc || rounds <= 0)
+        usage();
+
+    for (; i < argc; ++i)
+        if (load_trace(argv[i]))
+            return 1;
+
+    replay(rounds);
+    report();
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include "mc_sim.h"
+
+#include "pico/platform.h"
+
+#include "des.h"
+#include "ps2/ps2_ecc.h"
+#include "ps2/ps2_cardman.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the rest of what ps2_memory_card.c provides to the handlers, same names and meaning */
+
+#define ERASE_SECTORS 16
+#define TERM_CK_ERROR 0x66
+
+static uint8_t term = 0xFF;
+static uint32_t read_sector, write_sector, erase_sector;
+static int is_write;
+static uint32_t readptr, writeptr;
+static bool flash_mode;
+static ps2_mc_errors_t mc_errors;
+static uint8_t hostkey[9];
+
+int ps2_magicgate = 1;
+uint8_t ps2_civ[8];
+
+typedef struct {
+    uint32_t prefix;
+    uint8_t buf[528];
+    uint32_t sector;
+} readbuf_t;
+
+static readbuf_t readbuf;
+static readbuf_t *readtmp = &readbuf;
+
+typedef struct {
+    uint8_t buf[528];
+} writebuf_t;
+
+static writebuf_t writetmp;
+
+static uint8_t iv[8];
+static uint8_t seed[8];
+static uint8_t nonce[8];
+static uint8_t MechaChallenge3[8];
+static uint8_t MechaChallenge2[8];
+static uint8_t MechaChallenge1[8];
+static uint8_t CardResponse1[8];
+static uint8_t CardResponse2[8];
+static uint8_t CardResponse3[8];
+
+static uint8_t cex_key[16] = { 0x06, 0x46, 0x7a, 0x6c, 0x5b, 0x9b, 0x82, 0x77, 0x0d, 0xdf, 0xe9, 0x7e, 0x24, 0x5b, 0x9f, 0xca };
+
+static uint8_t *card;
+static uint32_t card_size;
+static uint32_t marked;
+static int sim_full;
+
+void debug_printf(const char *format, ...) {
+    (void)format;
+}
+
+void host_idle(void) {
+}
+
+uint32_t ps2_cardman_get_card_size(void) {
+    return card_size;
+}
+
+/* the hooks - there's no psram in between, so everything lands before the call returns */
+
+static const uint8_t *sim_in;
+static size_t sim_in_len, sim_in_pos;
+static uint8_t *sim_out;
+static size_t sim_out_len, sim_out_max;
+
+#define recv() do { \
+    if (sim_in_pos == sim_in_len) \
+        return; \
+    cmd = sim_in[sim_in_pos++]; \
+} while (0)
+
+static void send(uint8_t ch) {
+    if (sim_out_len < sim_out_max)
+        sim_out[sim_out_len++] = ch;
+}
+
+static void send_stream(const uint8_t *buf, uint32_t len) {
+    while (len--)
+        send(*buf++);
+}
+
+static void read_mc(uint32_t sector) {
+    readtmp->sector = sector;
+    memcpy(readtmp->buf, &card[sector * 512], 512);
+    ps2_ecc_sector(readtmp->buf, &readtmp->buf[512]);
+}
+
+static void read_mc_ahead(void) {
+}
+
+static void read_mc_invalidate(uint32_t sector, uint32_t count) {
+    (void)sector;
+    (void)count;
+}
+
+static void read_mc_wait(void) {
+}
+
+static void read_mc_wait_ecc(void) {
+}
+
+static void erase_mc(uint32_t sector, uint32_t count) {
+    memset(&card[sector * 512], 0xFF, count * 512);
+}
+
+static void write_mc_commit(uint32_t sector) {
+    memcpy(&card[sector * 512], writetmp.buf, 512);
+}
+
+static void write_mc_wait(void) {
+}
+
+static int write_mc_full(void) {
+    return sim_full;
+}
+
+static void ps2_dirty_note_access(void) {
+}
+
+static void ps2_dirty_mark_range(uint32_t sector, uint32_t count) {
+    (void)sector;
+    marked += count;
+}
+
+static void ps2_dirty_mark(uint32_t sector) {
+    ps2_dirty_mark_range(sector, 1);
+}
+
+/* same as ps2_memory_card.c, the 0x0E step is part of what gets timed */
+static void doubleDesEncrypt(void *key, void *data) {
+    DesContext dc;
+    desInit(&dc, (uint8_t *)key, 8);
+    desEncryptBlock(&dc, data, data);
+    desInit(&dc, &((uint8_t *)key)[8], 8);
+    desDecryptBlock(&dc, data, data);
+    desInit(&dc, (uint8_t *)key, 8);
+    desEncryptBlock(&dc, data, data);
+}
+
+static void doubleDesDecrypt(void *key, void *data) {
+    DesContext dc;
+    desInit(&dc, (uint8_t *)key, 8);
+    desDecryptBlock(&dc, data, data);
+    desInit(&dc, &((uint8_t *)key)[8], 8);
+    desEncryptBlock(&dc, data, data);
+    desInit(&dc, (uint8_t *)key, 8);
+    desDecryptBlock(&dc, data, data);
+}
+
+static void xor_bit(const uint8_t *a, const uint8_t *b, uint8_t *result, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        result[i] = a[i] ^ b[i];
+}
+
+static void generateResponse(void) {
+    doubleDesDecrypt(cex_key, MechaChallenge1);
+    uint8_t random[8] = { 0 };
+    xor_bit(MechaChallenge1, ps2_civ, random, 8);
+    xor_bit(nonce, ps2_civ, CardResponse1, 8);
+    doubleDesEncrypt(cex_key, CardResponse1);
+    xor_bit(random, CardResponse1, CardResponse2, 8);
+    doubleDesEncrypt(cex_key, CardResponse2);
+    uint8_t CardKey[] = { 'M', 'e', 'c', 'h', 'a', 'P', 'w', 'n' };
+    xor_bit(CardKey, CardResponse2, CardResponse3, 8);
+    doubleDesEncrypt(cex_key, CardResponse3);
+}
+
+typedef void (*mc_handler_t)(void);
+
+static uint8_t mc_ch;
+static uint8_t mc_auth_ch;
+
+#include "ps2/ps2_memory_card.in.c"
+
+void mc_sim_init(uint32_t size) {
+    static bool cmds_ready;
+    if (!cmds_ready) {
+        mc_init_cmds();
+        cmds_ready = true;
+    }
+
+    free(card);
+    card = malloc(size);
+    if (!card)
+        abort();
+    memset(card, 0xFF, size);
+    card_size = size;
+
+    term = 0xFF;
+    read_sector = write_sector = erase_sector = 0;
+    is_write = 0;
+    readptr = writeptr = 0;
+    memset(&mc_errors, 0, sizeof(mc_errors));
+    memset(&readbuf, 0, sizeof(readbuf));
+    marked = 0;
+    sim_full = 0;
+
+    for (int i = 0; i < 8; i++) {
+        iv[i] = 0x42;
+        seed[i] = iv[i];
+        nonce[i] = 0x42;
+    }
+}
+
+void mc_sim_set_magicgate(int enabled) {
+    ps2_magicgate = enabled;
+}
+
+void mc_sim_set_full(int full) {
+    sim_full = full;
+}
+
+size_t mc_sim_transaction(const uint8_t *in, size_t len, uint8_t *out, size_t out_max) {
+    sim_in = in;
+    sim_in_len = len;
+    sim_in_pos = 0;
+    sim_out = out;
+    sim_out_len = 0;
+    sim_out_max = out_max;
+
+    mc_transaction();
+
+    return sim_out_len;
+}
+
+uint8_t *mc_sim_card(void) {
+    return card;
+}
+
+void mc_sim_get_errors(ps2_mc_errors_t *errors) {
+    *errors = mc_errors;
+}
+
+uint32_t mc_sim_get_marked(void) {
+    return marked;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ps2/ps2_memory_card.h"
+
+/*
+ * The 0x81 transaction handlers of ps2_memory_card.in.c on the host. The PIO FIFOs are a byte
+ * array going in and one coming out, the card lives in memory and reads land right away.
+ */
+
+/* starts over with a card of card_size bytes of 0xFF and the terminator reset */
+void mc_sim_init(uint32_t card_size);
+void mc_sim_set_magicgate(int enabled);
+/* pretend psram had to drop a write, so commits get refused */
+void mc_sim_set_full(int full);
+
+/* runs one transaction on the bytes the console sends after 0x81, out gets the card's reply to
+   each of them in order. returns the number of reply bytes - the handler stops early when in runs
+   out, like it does when the card gets deselected */
+size_t mc_sim_transaction(const uint8_t *in, size_t len, uint8_t *out, size_t out_max);
+
+uint8_t *mc_sim_card(void);
+void mc_sim_get_errors(ps2_mc_errors_t *errors);
+/* sectors handed to the dirty tracker so far */
+uint32_t mc_sim_get_marked(void);
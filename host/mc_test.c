@@ -0,0 +1,240 @@
+/* round trips through the 0x81 transaction handlers - run by `make test` */
+
+#include "mc_sim.h"
+
+#include "ps2/ps2_ecc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define CARD_SIZE (8 * 1024 * 1024)
+
+static int failed;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        ++failed; \
+    } \
+} while (0)
+
+static uint8_t in[1024], out[1024];
+
+static size_t run(size_t len) {
+    memset(out, 0, sizeof(out));
+    return mc_sim_transaction(in, len, out, sizeof(out));
+}
+
+/* 0x21/0x22/0x23 with the address and its checksum, flipped to a bad one if asked */
+static size_t addr_cmd(uint8_t ch, uint32_t addr, int bad_ck) {
+    in[0] = ch;
+    memcpy(&in[1], &addr, 4);
+    in[5] = (uint8_t)(in[1] ^ in[2] ^ in[3] ^ in[4] ^ (bad_ck ? 1 : 0));
+    in[6] = in[7] = 0;
+    return run(8);
+}
+
+static void write_sector(uint32_t sector, const uint8_t *data) {
+    CHECK(addr_cmd(0x22, sector, 0) == 8 && out[7] == 0xFF);
+
+    /* the console sends 4 blocks of 128 plus the 16 spare bytes */
+    for (int off = 0; off < 528; off += 128) {
+        int sz = (off == 512) ? 16 : 128;
+        uint8_t ck = 0;
+        in[0] = 0x42;
+        in[1] = (uint8_t)sz;
+        for (int i = 0; i < sz; ++i) {
+            in[2 + i] = data[off + i];
+            ck ^= data[off + i];
+        }
+        in[2 + sz] = ck;
+        in[3 + sz] = in[4 + sz] = 0;
+        CHECK(run(sz + 5) == (size_t)sz + 5);
+        CHECK(out[3 + sz] == 0x2B && out[4 + sz] == 0xFF);
+    }
+
+    in[0] = 0x81;
+    in[1] = in[2] = 0;
+    CHECK(run(3) == 3 && out[1] == 0x2B && out[2] == 0xFF);
+}
+
+static void read_sector(uint32_t sector, uint8_t *data) {
+    CHECK(addr_cmd(0x23, sector, 0) == 8 && out[6] == 0x2B && out[7] == 0xFF);
+
+    for (int off = 0; off < 528; off += 128) {
+        int sz = (off == 512) ? 16 : 128;
+        memset(in, 0, sizeof(in));
+        in[0] = 0x43;
+        in[1] = (uint8_t)sz;
+        CHECK(run(sz + 5) == (size_t)sz + 5);
+        CHECK(out[2] == 0x2B);
+
+        uint8_t ck = 0;
+        for (int i = 0; i < sz; ++i) {
+            data[off + i] = out[3 + i];
+            ck ^= out[3 + i];
+        }
+        CHECK(out[3 + sz] == ck);
+        CHECK(out[4 + sz] == 0xFF);
+    }
+}
+
+static void test_ack(void) {
+    in[0] = 0x11;
+    in[1] = in[2] = 0;
+    CHECK(run(3) == 3);
+    CHECK(out[0] == 0xFF && out[1] == 0x2B && out[2] == 0xFF);
+}
+
+static void test_get_specs(void) {
+    memset(in, 0, 12);
+    in[0] = 0x26;
+    CHECK(run(12) == 12);
+    static const uint8_t specs[] = { 0xFF, 0x2B, 0x00, 0x02, 0x10, 0x00, 0x00, 0x40, 0x00, 0x00, 0x52, 0xFF };
+    CHECK(memcmp(out, specs, sizeof(specs)) == 0);
+}
+
+static void test_term(void) {
+    in[0] = 0x27;
+    in[1] = 0x55;
+    in[2] = in[3] = 0;
+    CHECK(run(4) == 4 && out[2] == 0x2B && out[3] == 0x55);
+
+    memset(in, 0, 4);
+    in[0] = 0x28;
+    CHECK(run(4) == 4 && out[1] == 0x2B && out[2] == 0x55 && out[3] == 0x55);
+
+    in[0] = 0x27;
+    in[1] = 0xFF;
+    CHECK(run(4) == 4);
+}
+
+static void test_write_read(void) {
+    uint8_t data[528], back[528];
+    for (int i = 0; i < 512; ++i)
+        data[i] = (uint8_t)(i * 7 + 3);
+    ps2_ecc_sector(data, &data[512]);
+
+    uint32_t marked = mc_sim_get_marked();
+    write_sector(5, data);
+    CHECK(memcmp(&mc_sim_card()[5 * 512], data, 512) == 0);
+    CHECK(mc_sim_get_marked() == marked + 1);
+
+    read_sector(5, back);
+    CHECK(memcmp(back, data, sizeof(data)) == 0);
+
+    /* the next sector was never written */
+    read_sector(6, back);
+    uint8_t blank[528];
+    memset(blank, 0xFF, 512);
+    ps2_ecc_sector(blank, &blank[512]);
+    CHECK(memcmp(back, blank, sizeof(blank)) == 0);
+}
+
+static void test_erase(void) {
+    uint8_t data[528];
+    memset(data, 0x00, sizeof(data));
+    write_sector(17, data);
+
+    uint32_t marked = mc_sim_get_marked();
+    CHECK(addr_cmd(0x21, 16, 0) == 8 && out[7] == 0xFF);
+    in[0] = 0x82;
+    in[1] = in[2] = 0;
+    CHECK(run(3) == 3 && out[1] == 0x2B && out[2] == 0xFF);
+    CHECK(mc_sim_get_marked() == marked + 16);
+
+    int blank = 1;
+    for (int i = 16 * 512; i < 32 * 512; ++i)
+        blank &= mc_sim_card()[i] == 0xFF;
+    CHECK(blank);
+}
+
+static void test_bad_checksum(void) {
+    ps2_mc_errors_t errors;
+    uint8_t data[528];
+    memset(data, 0x5A, sizeof(data));
+
+    /* a bad 0x23 answers 0x66 and keeps serving the previous sector */
+    write_sector(40, data);
+    uint8_t back[528];
+    read_sector(40, back);
+    CHECK(addr_cmd(0x23, 41, 1) == 8 && out[7] == 0x66);
+    mc_sim_get_errors(&errors);
+    CHECK(errors.read_addr == 1);
+
+    /* a bad 0x42 drops the write, the 0x81 after it commits nothing */
+    CHECK(addr_cmd(0x22, 41, 0) == 8);
+    memset(in, 0, sizeof(in));
+    in[0] = 0x42;
+    in[1] = 4;
+    in[2] = 1;
+    in[6] = 0; /* checksum should be 1 */
+    CHECK(run(9) == 9 && out[8] == 0x66);
+    in[0] = 0x81;
+    CHECK(run(3) == 3);
+    CHECK(mc_sim_card()[41 * 512] == 0xFF);
+    mc_sim_get_errors(&errors);
+    CHECK(errors.write_data == 1);
+}
+
+static void test_full(void) {
+    uint8_t data[528];
+    memset(data, 0x3C, sizeof(data));
+
+    /* once psram dropped a write the commit answers 0x66 and nothing gets marked or stored */
+    mc_sim_set_full(1);
+    uint32_t marked = mc_sim_get_marked();
+    CHECK(addr_cmd(0x22, 50, 0) == 8);
+    for (int off = 0; off < 528; off += 128) {
+        int sz = (off == 512) ? 16 : 128;
+        uint8_t ck = 0;
+        in[0] = 0x42;
+        in[1] = (uint8_t)sz;
+        for (int i = 0; i < sz; ++i) {
+            in[2 + i] = data[off + i];
+            ck ^= data[off + i];
+        }
+        in[2 + sz] = ck;
+        CHECK(run(sz + 5) == (size_t)sz + 5);
+    }
+    in[0] = 0x81;
+    in[1] = in[2] = 0;
+    CHECK(run(3) == 3 && out[1] == 0x2B && out[2] == 0x66);
+    CHECK(mc_sim_card()[50 * 512] == 0xFF);
+    CHECK(mc_sim_get_marked() == marked);
+    mc_sim_set_full(0);
+}
+
+static void test_magicgate(void) {
+    memset(in, 0, 16);
+    in[0] = 0xF0;
+    in[1] = 0x01;
+    CHECK(run(13) == 13);
+    /* 0x2B, the iv most significant first, its checksum (0x42 xor'd 8 times) and the terminator */
+    CHECK(out[2] == 0x2B && out[3] == 0x42 && out[10] == 0x42 && out[11] == 0x00 && out[12] == 0xFF);
+
+    /* without MagicGate the card doesn't answer past the sub command */
+    mc_sim_set_magicgate(0);
+    CHECK(run(13) == 1);
+    mc_sim_set_magicgate(1);
+}
+
+int main(void) {
+    mc_sim_init(CARD_SIZE);
+
+    test_ack();
+    test_get_specs();
+    test_term();
+    test_write_read();
+    test_erase();
+    test_bad_checksum();
+    test_full();
+    test_magicgate();
+
+    if (failed) {
+        printf("mc_test: %d checks failed\n", failed);
+        return 1;
+    }
+    printf("mc_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * psram_benchmark and the self-tests of ps2_psram.c on the fake qspi backend. The bus times come
+ * from the clock model, everything around them - the scheduler, the slot map and the waits - is
+ * the real code running on the host cpu.
+ *
+ *   psram_bench [-c clkdiv]    clkdiv in quarters like the settings, e.g. 4 for 1.00; 0 calibrates
+ */
+
+#include "ps2/ps2_psram.h"
+
+#include "bigmem.h"
+#include "settings.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fake_qspi.h"
+
+bigmem_t bigmem;
+
+static int psram_clkdiv, psram_sample_delay;
+
+int settings_get_psram_clkdiv(void) {
+    return psram_clkdiv;
+}
+
+int settings_get_psram_sample_delay(void) {
+    return psram_sample_delay;
+}
+
+void settings_set_psram_timing(int clkdiv, int sample_delay) {
+    psram_clkdiv = clkdiv;
+    psram_sample_delay = sample_delay;
+}
+
+void fatal(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void debug_printf(const char *format, ...) {
+    (void)format;
+}
+
+static void print_bus(const char *what) {
+    fake_qspi_stats_t s;
+    fake_qspi_get_stats(&s);
+    printf("%s: %u bursts, longest %llu ns, %u over tCEM\n", what, s.transfers,
+        (unsigned long long)s.max_burst_ns, s.tcem_violations);
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && !strcmp(argv[1], "-c")) {
+        psram_clkdiv = atoi(argv[2]);
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: psram_bench [-c clkdiv]\n");
+        return 2;
+    }
+
+    psram_init();
+    print_bus("init");
+
+    psram_test_result_t test;
+    static const char *test_names[] = { "quick", "thorough" };
+    for (int mode = PSRAM_TEST_QUICK; mode <= PSRAM_TEST_THOROUGH; ++mode) {
+        fake_qspi_reset_stats();
+        if (!psram_self_test(mode, &test)) {
+            printf("%s test failed at 0x%06X: expected %02X got %02X\n", test_names[mode],
+                (unsigned)test.fail_addr, test.expected, test.got);
+            return 1;
+        }
+        printf("%s test: %u bytes in %u us\n", test_names[mode], (unsigned)test.bytes, (unsigned)test.us);
+        print_bus(test_names[mode]);
+    }
+
+    fake_qspi_reset_stats();
+    psram_bench_result_t res[PSRAM_BENCH_NUM * 8];
+    psram_benchmark(res, sizeof(res) / sizeof(*res));
+    print_bus("bench");
+
+    fake_qspi_stats_t s;
+    fake_qspi_get_stats(&s);
+    return s.tcem_violations ? 1 : 0;
+}
@@ -7,8 +7,9 @@ typedef union {
         uint8_t dirty_map[1024]; /* every 128 byte block */
     } ps1;
     struct {
-        uint16_t dirty_heap[8 * 1024 * 1024 / 512];
-        uint8_t dirty_map[8 * 1024 * 1024 / 512]; // TODO: make an actual bitmap to save 8x mem?
+        uint32_t dirty_map[16 * 1024 * 1024 / 512 / 32]; /* a bit per sector */
+        uint16_t psram_map[16 * 1024 * 1024 / 512]; /* psram slot + 1 of every sector, 0 if it's all 0xFF */
+        uint8_t bulk_buf[16 * 1024] __attribute__((aligned(4))); /* card loads and psram tests go through here */
     } ps2;
 } bigmem_t;
 
@@ -17,7 +17,8 @@
 #define PSRAM_CS 2
 #define PSRAM_CLK 3
 #define PSRAM_DAT 4  /* IO0-IO3 must be sequential! */
-#define PSRAM_CLKDIV 2
+#define PSRAM_CLKDIV 2      /* used for setup and as the slowest setting tried by calibration */
+#define PSRAM_CLKDIV_MIN 1  /* fastest setting tried by calibration, SCK is clk_sys / 4 / clkdiv */
 
 #define SD_PERIPH spi1
 #define SD_MISO 24
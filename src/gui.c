@@ -19,6 +19,7 @@
 #include "ps2/ps2_cardman.h"
 #include "ps2/ps2_dirty.h"
 #include "ps2/ps2_exploit.h"
+#include "ps2/ps2_psram.h"
 
 #include "version/version.h"
 
@@ -29,7 +30,8 @@ static lv_obj_t *g_navbar, *g_progress_bar, *g_progress_text, *g_activity_frame;
 
 static lv_obj_t *scr_switch_nag, *scr_card_switch, *scr_main, *scr_menu, *scr_freepsxboot, *menu, *main_page;
 static lv_style_t style_inv;
-static lv_obj_t *scr_main_idx_lbl, *scr_main_channel_lbl,*src_main_title_lbl, *lbl_civ_err, *lbl_autoboot, *lbl_channel;
+static lv_obj_t *scr_main_idx_lbl, *scr_main_channel_lbl,*src_main_title_lbl, *lbl_civ_err, *lbl_autoboot, *lbl_journal, *lbl_channel, *lbl_psram_test, *psram_test_back, *lbl_psram_bench, *psram_bench_back;
+static lv_obj_t *lbl_ck_errors[4], *lbl_flush_stats[4];
 
 static int have_oled;
 static int switching_card;
@@ -179,6 +181,9 @@ static void gui_tick(void) {
     }
 }
 
+/* what the progress bar is showing, a card load or a drain */
+static char *(*progress_text)(void) = ps2_cardman_get_progress_text;
+
 static void reload_card_cb(int progress) {
     static lv_point_t line_points[2] = { {0, DISPLAY_HEIGHT/2}, {0, DISPLAY_HEIGHT/2} };
     static int prev_progress;
@@ -189,11 +194,23 @@ static void reload_card_cb(int progress) {
     line_points[1].x = DISPLAY_WIDTH * progress / 100;
     lv_line_set_points(g_progress_bar, line_points, 2);
 
-    lv_label_set_text(g_progress_text, ps2_cardman_get_progress_text());
+    lv_label_set_text(g_progress_text, progress_text());
 
     gui_tick();
 }
 
+/* everything the console wrote has to be on sd before the card goes away - the card switch screen
+   shows how far along that is, then whatever was up before comes back */
+static void gui_ps2_drain(void) {
+    lv_obj_t *prev = lv_scr_act();
+
+    UI_GOTO_SCREEN(scr_card_switch);
+    progress_text = ps2_dirty_get_progress_text;
+    ps2_dirty_drain(reload_card_cb);
+    progress_text = ps2_cardman_get_progress_text;
+    lv_scr_load(prev);
+}
+
 static void evt_scr_main(lv_event_t *event) {
     if (event->code == LV_EVENT_KEY) {
         uint32_t key = lv_indev_get_key(lv_indev_get_act());
@@ -257,6 +274,8 @@ static void evt_scr_main(lv_event_t *event) {
 
                 if ((prevChannel != ps2_cardman_get_channel()) || (prevIdx != ps2_cardman_get_idx())) {
                     ps2_memory_card_exit();
+                    /* the card stays in psram, so it has to be clean when switching away */
+                    gui_ps2_drain();
                     ps2_cardman_close();
                     switching_card = 1;
                     printf("new PS2 card=%d chan=%d\n", ps2_cardman_get_idx(), ps2_cardman_get_channel());
@@ -325,6 +344,13 @@ static void evt_go_back(lv_event_t *event) {
     lv_event_stop_bubbling(event);
 }
 
+static void evt_ps2_journal(lv_event_t *event) {
+    bool current = settings_get_ps2_journal();
+    settings_set_ps2_journal(!current);
+    lv_label_set_text(lbl_journal, !current ? "Yes" : "No");
+    lv_event_stop_bubbling(event);
+}
+
 static void evt_ps2_autoboot(lv_event_t *event) {
     bool current = settings_get_ps2_autoboot();
     settings_set_ps2_autoboot(!current);
@@ -343,9 +369,111 @@ static void evt_do_civ_deploy(lv_event_t *event) {
     }
 }
 
+/* the psram test and benchmark wipe psram, so everything has to be on the card before and it gets loaded again after */
+static void psram_tool_begin(void) {
+    ps2_memory_card_exit();
+    gui_ps2_drain();
+    ps2_cardman_close();
+    ps2_cardman_evict_all();
+}
+
+static void psram_tool_end(lv_obj_t *back) {
+    gui_do_ps2_card_switch();
+    lv_scr_load(scr_menu);
+    lv_group_focus_obj(back);
+}
+
+static void evt_do_psram_test(lv_event_t *event) {
+    (void)event;
+    static char text[32];
+
+    if (settings_get_mode() != MODE_PS2) {
+        lv_label_set_text(lbl_psram_test, "PS2 mode only");
+        return;
+    }
+
+    lv_label_set_text(lbl_psram_test, "Testing...");
+    gui_tick();
+
+    psram_tool_begin();
+
+    psram_test_result_t res;
+    if (psram_self_test(PSRAM_TEST_THOROUGH, &res))
+        snprintf(text, sizeof(text), "OK %u kB/s", (unsigned)((uint64_t)res.bytes * 1000000 / res.us / 1024));
+    else
+        snprintf(text, sizeof(text), "FAIL 0x%06X", (unsigned)res.fail_addr);
+    printf("PSRAM thorough test: %s, %u bytes in %u ms\n", text, (unsigned)res.bytes, (unsigned)(res.us / 1000));
+
+    lv_label_set_text(lbl_psram_test, text);
+    psram_tool_end(psram_test_back);
+}
+
+static void evt_show_ps2_stats(lv_event_t *event) {
+    (void)event;
+    ps2_mc_errors_t errors;
+    static char text[4][12];
+
+    ps2_memory_card_get_errors(&errors);
+    uint32_t counts[4] = { errors.erase_addr, errors.write_addr, errors.read_addr, errors.write_data };
+    for (int i = 0; i < 4; ++i) {
+        snprintf(text[i], sizeof(text[i]), "%u", (unsigned)counts[i]);
+        lv_label_set_text(lbl_ck_errors[i], text[i]);
+    }
+
+    ps2_dirty_stats_t stats;
+    static char flush_text[4][16];
+
+    ps2_dirty_get_stats(&stats);
+    snprintf(flush_text[0], sizeof(flush_text[0]), "%u", (unsigned)stats.dirty);
+    snprintf(flush_text[1], sizeof(flush_text[1]), "%ums", (unsigned)stats.max_lag_ms);
+    snprintf(flush_text[2], sizeof(flush_text[2]), "%ums", (unsigned)(stats.gap_us / 1000));
+    snprintf(flush_text[3], sizeof(flush_text[3]), "%u", (unsigned)stats.urgent);
+    for (int i = 0; i < 4; ++i)
+        lv_label_set_text(lbl_flush_stats[i], flush_text[i]);
+    printf("card stats: %u dirty, oldest %u ms, max lag %u ms, gap %u us, %u urgent, ring full %u\n",
+        (unsigned)stats.dirty, (unsigned)stats.lag_ms, (unsigned)stats.max_lag_ms, (unsigned)stats.gap_us,
+        (unsigned)stats.urgent, (unsigned)stats.ring_full);
+}
+
+static void evt_do_psram_bench(lv_event_t *event) {
+    (void)event;
+    static char text[64];
+    static psram_bench_result_t res[PSRAM_BENCH_NUM * 8];
+
+    if (settings_get_mode() != MODE_PS2) {
+        lv_label_set_text(lbl_psram_bench, "PS2 mode only");
+        return;
+    }
+
+    lv_label_set_text(lbl_psram_bench, "Running...");
+    gui_tick();
+
+    psram_tool_begin();
+
+    /* the full table goes to the console, the screen only has room for the 512 byte sector reads and writes */
+    int num = psram_benchmark(res, sizeof(res) / sizeof(*res));
+    unsigned rd = 0, wr = 0;
+    for (int i = 0; i < num; ++i) {
+        unsigned kbs = (unsigned)((uint64_t)res[i].size * res[i].count * 1000000 / res[i].us / 1024);
+        if (res[i].size == 512 && res[i].kind == PSRAM_BENCH_READ_DMA)
+            rd = kbs;
+        if (res[i].size == 512 && res[i].kind == PSRAM_BENCH_WRITE_DMA)
+            wr = kbs;
+    }
+    snprintf(text, sizeof(text), "Rd %u kB/s\nWr %u kB/s", rd, wr);
+
+    lv_label_set_text(lbl_psram_bench, text);
+    psram_tool_end(psram_bench_back);
+}
+
 static void evt_switch_to_ps1(lv_event_t *event) {
     (void)event;
 
+    if (settings_get_mode() == MODE_PS2) {
+        ps2_memory_card_exit();
+        gui_ps2_drain();
+        ps2_cardman_close();
+    }
     settings_set_mode(MODE_PS1);
 
     UI_GOTO_SCREEN(scr_switch_nag);
@@ -584,11 +712,82 @@ static void create_menu_screen(void) {
         lbl_autoboot = ui_label_create(cont, settings_get_ps2_autoboot() ? " Yes" : " No");
         lv_obj_add_event_cb(cont, evt_ps2_autoboot, LV_EVENT_CLICKED, NULL);
 
+        cont = ui_menu_cont_create_nav(ps2_page);
+        ui_label_create_grow_scroll(cont, "Journal writes");
+        lbl_journal = ui_label_create(cont, settings_get_ps2_journal() ? " Yes" : " No");
+        lv_obj_add_event_cb(cont, evt_ps2_journal, LV_EVENT_CLICKED, NULL);
+
         cont = ui_menu_cont_create_nav(ps2_page);
         ui_label_create_grow(cont, "Deploy CIV.bin");
         ui_label_create(cont, ">");
         ui_menu_set_load_page_event(menu, cont, civ_page);
         lv_obj_add_event_cb(cont, evt_do_civ_deploy, LV_EVENT_CLICKED, NULL);
+
+        /* psram test submenu */
+        lv_obj_t *psram_test_page = ui_menu_subpage_create(menu, "Test PSRAM");
+        {
+            cont = ui_menu_cont_create(psram_test_page);
+            ui_label_create(cont, "");
+            cont = ui_menu_cont_create(psram_test_page);
+            lbl_psram_test = ui_label_create(cont, "");
+
+            cont = ui_menu_cont_create_nav(psram_test_page);
+            ui_label_create(cont, "Back");
+            lv_obj_add_event_cb(cont, evt_go_back, LV_EVENT_CLICKED, NULL);
+            psram_test_back = cont;
+        }
+
+        cont = ui_menu_cont_create_nav(ps2_page);
+        ui_label_create_grow(cont, "Test PSRAM");
+        ui_label_create(cont, ">");
+        ui_menu_set_load_page_event(menu, cont, psram_test_page);
+        lv_obj_add_event_cb(cont, evt_do_psram_test, LV_EVENT_CLICKED, NULL);
+
+        /* psram benchmark submenu */
+        lv_obj_t *psram_bench_page = ui_menu_subpage_create(menu, "Benchmark PSRAM");
+        {
+            cont = ui_menu_cont_create(psram_bench_page);
+            ui_label_create(cont, "");
+            cont = ui_menu_cont_create(psram_bench_page);
+            lbl_psram_bench = ui_label_create(cont, "");
+
+            cont = ui_menu_cont_create_nav(psram_bench_page);
+            ui_label_create(cont, "Back");
+            lv_obj_add_event_cb(cont, evt_go_back, LV_EVENT_CLICKED, NULL);
+            psram_bench_back = cont;
+        }
+
+        cont = ui_menu_cont_create_nav(ps2_page);
+        ui_label_create_grow(cont, "Benchmark PSRAM");
+        ui_label_create(cont, ">");
+        ui_menu_set_load_page_event(menu, cont, psram_bench_page);
+        lv_obj_add_event_cb(cont, evt_do_psram_bench, LV_EVENT_CLICKED, NULL);
+
+        /* stats submenu, filled in when it's opened */
+        lv_obj_t *stats_page = ui_menu_subpage_create(menu, "Card stats");
+        {
+            /* commands the console had to retry because their checksum didn't match */
+            static const char *ck_names[4] = { "Bad erase addr", "Bad write addr", "Bad read addr", "Bad write data" };
+            for (int i = 0; i < 4; ++i) {
+                cont = ui_menu_cont_create_nav(stats_page);
+                ui_label_create_grow_scroll(cont, ck_names[i]);
+                lbl_ck_errors[i] = ui_label_create(cont, "");
+            }
+
+            /* how the flushes to sd keep up */
+            static const char *flush_names[4] = { "To flush", "Max lag", "Console gap", "Urgent flushes" };
+            for (int i = 0; i < 4; ++i) {
+                cont = ui_menu_cont_create_nav(stats_page);
+                ui_label_create_grow_scroll(cont, flush_names[i]);
+                lbl_flush_stats[i] = ui_label_create(cont, "");
+            }
+        }
+
+        cont = ui_menu_cont_create_nav(ps2_page);
+        ui_label_create_grow(cont, "Card stats");
+        ui_label_create(cont, ">");
+        ui_menu_set_load_page_event(menu, cont, stats_page);
+        lv_obj_add_event_cb(cont, evt_show_ps2_stats, LV_EVENT_CLICKED, NULL);
     }
 
     /* Info submenu */
@@ -805,6 +1004,14 @@ void gui_task(void) {
             gui_do_ps2_card_switch();
         }
 
+        /* psram filled up and writes are being refused, the title line is free on ps2 */
+        static int displayed_full;
+        int full = psram_get_dropped_sectors() != 0;
+        if (displayed_full != full) {
+            displayed_full = full;
+            lv_label_set_text(src_main_title_lbl, full ? "PSRAM full, not saving!" : "");
+        }
+
         if (ps2_dirty_activity) {
             input_flush();
             lv_obj_clear_flag(g_activity_frame, LV_OBJ_FLAG_HIDDEN);
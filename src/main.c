@@ -27,6 +27,7 @@
 #include "ps2/ps2_cardman.h"
 #include "ps2/ps2_psram.h"
 #include "ps2/ps2_exploit.h"
+#include "ps2/ps2_mc_timing.h"
 
 /* reboot to bootloader if either button is held on startup
    to make the device easier to flash when assembled inside case */
@@ -131,6 +132,7 @@ int main() {
         while (1) {
             debug_task();
             ps2_dirty_task();
+            ps2_mc_timing_task();
             gui_task();
             input_task();
         }
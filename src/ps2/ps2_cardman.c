@@ -1,6 +1,7 @@
 #include "ps2_cardman.h"
 
 #include <ps2/ps2_exploit.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,14 +11,20 @@
 #include "ps2_psram.h"
 #include "settings.h"
 
+#include "bigmem.h"
+#define cardbuf bigmem.ps2.bulk_buf
+
 #include "hardware/timer.h"
 
 
 #define PS2_DEFAULT_CARD_SIZE   PS2_CARD_SIZE_8M
 #define BLOCK_SIZE (512)
+/* the image is moved in chunks so sd and psram both get long transfers */
+#define CHUNK_SIZE (sizeof(cardbuf))
 
-static uint8_t flushbuf[BLOCK_SIZE];
 static int fd = -1;
+static int jfd = -1;
+static char journal_path[64];
 
 static int card_idx;
 static int card_chan;
@@ -27,6 +34,27 @@ static uint64_t cardprog_start;
 static size_t cardprog_pos;
 static int cardprog_wr;
 
+/*
+ * Cards of up to RESIDENT_SIZE stay in psram after switching away from them, each in its own
+ * part of the map, so coming back to one of them only has to move the map base. They share the
+ * chip and get pushed out least recently used first once a new card might not fit. A bigger card
+ * takes the whole map and pushes out everything else.
+ *
+ * The dirty sectors of a card are flushed before switching away, so the ones kept here always
+ * match what's on sd.
+ */
+#define RESIDENT_SIZE PS2_CARD_SIZE_2M
+#define NUM_RESIDENT (PS2_CARD_SIZE_16M / RESIDENT_SIZE)
+
+typedef struct {
+    int idx, chan;
+    uint32_t size; /* 0 if nothing is loaded here */
+    uint32_t last_use;
+} resident_t;
+
+static resident_t resident[NUM_RESIDENT];
+static uint32_t use_clock;
+
 void ps2_cardman_init(void) {
     if (settings_get_ps2_autoboot()) {
         card_idx = IDX_BOOT;
@@ -38,13 +66,18 @@ void ps2_cardman_init(void) {
 }
 
 int ps2_cardman_write_sector(int sector, void *buf512) {
+    return ps2_cardman_write_sectors(sector, buf512, 1);
+}
+
+/* a run of sectors in one go, so sd gets one long write instead of a seek per sector */
+int ps2_cardman_write_sectors(int sector, void *buf, uint32_t count) {
     if (fd < 0)
         return -1;
 
     if (sd_seek(fd, sector * BLOCK_SIZE) != 0)
         return -1;
 
-    if (sd_write(fd, buf512, BLOCK_SIZE) != BLOCK_SIZE)
+    if (sd_write(fd, buf, count * BLOCK_SIZE) != (int)(count * BLOCK_SIZE))
         return -1;
 
     return 0;
@@ -55,6 +88,203 @@ void ps2_cardman_flush(void) {
         sd_flush(fd);
 }
 
+/*
+ * Journaled write-back: a flush appends every dirty run to a journal next to the image, each behind
+ * a 512 byte header with a checksum, ends it with a commit record and only then writes the runs
+ * into the image. Once the image is flushed the journal gets cleared. The journal is always
+ * written front to back, so it costs sd a sequential append and a short header write per run.
+ *
+ * If power goes in the middle, a committed journal is written into the image again on the next
+ * open and one without a commit record is thrown away, so the image only ever changes a whole
+ * flush at a time.
+ */
+#define JOURNAL_MAGIC 0x4A325350 /* "PS2J" */
+
+enum { JOURNAL_RUN = 1, JOURNAL_COMMIT = 2 };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t gen;    /* the same for every record of one flush */
+    uint32_t type;
+    uint32_t sector; /* first sector of the run */
+    uint32_t count;  /* sectors that follow, for the commit the number of runs before it */
+    uint32_t sum;    /* of the data that follows */
+    uint32_t hdr_sum;
+} journal_rec_t;
+
+static uint8_t journal_block[BLOCK_SIZE] __attribute__((aligned(4)));
+static uint32_t journal_gen, journal_pos, journal_runs;
+/* committed but not known to be in the image yet, so it mustn't be written over */
+static int journal_pending;
+
+uint32_t ps2_cardman_journal_sum(const void *buf, uint32_t sz) {
+    /* FNV-1a over words */
+    const uint32_t *words = buf;
+    uint32_t sum = 2166136261u;
+    for (uint32_t i = 0; i < sz / 4; ++i)
+        sum = (sum ^ words[i]) * 16777619u;
+    return sum;
+}
+
+static int journal_put(uint32_t type, uint32_t sector, uint32_t count, uint32_t sum) {
+    journal_rec_t *rec = (journal_rec_t*)journal_block;
+    memset(journal_block, 0, sizeof(journal_block));
+    rec->magic = JOURNAL_MAGIC;
+    rec->gen = journal_gen;
+    rec->type = type;
+    rec->sector = sector;
+    rec->count = count;
+    rec->sum = sum;
+    rec->hdr_sum = ps2_cardman_journal_sum(rec, offsetof(journal_rec_t, hdr_sum));
+
+    if (sd_seek(jfd, journal_pos) != 0 || sd_write(jfd, journal_block, BLOCK_SIZE) != BLOCK_SIZE)
+        return -1;
+    journal_pos += BLOCK_SIZE;
+    return 0;
+}
+
+/* reads the record at pos, 0 if it's a valid one of generation gen (any if gen is 0) */
+static int journal_get(uint32_t pos, uint32_t gen, journal_rec_t *rec) {
+    if (sd_seek(jfd, pos) != 0 || sd_read(jfd, journal_block, BLOCK_SIZE) != BLOCK_SIZE)
+        return -1;
+    memcpy(rec, journal_block, sizeof(*rec));
+    if (rec->magic != JOURNAL_MAGIC || rec->hdr_sum != ps2_cardman_journal_sum(rec, offsetof(journal_rec_t, hdr_sum)))
+        return -1;
+    if (gen && rec->gen != gen)
+        return -1;
+    return 0;
+}
+
+static int journal_open(void) {
+    if (jfd < 0 && journal_path[0])
+        jfd = sd_open(journal_path, O_RDWR | O_CREAT);
+    return jfd < 0 ? -1 : 0;
+}
+
+/* a run that was cut short or has a garbled sector can't be let past the end of the image */
+static int journal_rec_fits(const journal_rec_t *rec, uint32_t image_sectors) {
+    return rec->sector < image_sectors && rec->count <= image_sectors - rec->sector;
+}
+
+/* writes the runs of a complete journal into the image and syncs it */
+static int journal_apply(uint32_t gen, uint32_t runs, uint32_t image_sectors) {
+    journal_rec_t rec;
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < runs; ++i) {
+        if (journal_get(pos, gen, &rec) != 0 || rec.count * BLOCK_SIZE > CHUNK_SIZE || !journal_rec_fits(&rec, image_sectors)
+            || ps2_cardman_journal_read(pos + BLOCK_SIZE, cardbuf, rec.count) != 0
+            || ps2_cardman_write_sectors(rec.sector, cardbuf, rec.count) != 0)
+            return -1;
+        pos += BLOCK_SIZE + rec.count * BLOCK_SIZE;
+    }
+    ps2_cardman_flush();
+    return 0;
+}
+
+/* a journal whose flush failed after the commit is still the only full copy of those runs, it has
+   to get into the image before anything else goes into the journal */
+static int journal_settle(void) {
+    if (!journal_pending)
+        return 0;
+    printf("applying the pending journal, %u runs... ", (unsigned)journal_runs);
+    if (journal_apply(journal_gen, journal_runs, card_size / BLOCK_SIZE) != 0) {
+        printf("FAILED\n");
+        return -1;
+    }
+    printf("OK!\n");
+    ps2_cardman_journal_retire();
+    return 0;
+}
+
+int ps2_cardman_journal_begin(void) {
+    if (journal_open() != 0 || journal_settle() != 0)
+        return -1;
+    /* a fresh generation so records left over from a longer flush before don't count */
+    journal_gen = (uint32_t)time_us_64() | 1;
+    journal_pos = 0;
+    journal_runs = 0;
+    return 0;
+}
+
+int ps2_cardman_journal_append(int sector, void *buf, uint32_t count, uint32_t sum, uint32_t *pos) {
+    if (journal_put(JOURNAL_RUN, sector, count, sum) != 0)
+        return -1;
+    *pos = journal_pos;
+    if (sd_write(jfd, buf, count * BLOCK_SIZE) != (int)(count * BLOCK_SIZE))
+        return -1;
+    journal_pos += count * BLOCK_SIZE;
+    ++journal_runs;
+    return 0;
+}
+
+int ps2_cardman_journal_commit(void) {
+    if (journal_put(JOURNAL_COMMIT, 0, journal_runs, 0) != 0)
+        return -1;
+    sd_flush(jfd);
+    journal_pending = 1;
+    return 0;
+}
+
+int ps2_cardman_journal_read(uint32_t pos, void *buf, uint32_t count) {
+    if (sd_seek(jfd, pos) != 0 || sd_read(jfd, buf, count * BLOCK_SIZE) != (int)(count * BLOCK_SIZE))
+        return -1;
+    return 0;
+}
+
+/* the image has everything, the next open mustn't apply this again */
+void ps2_cardman_journal_retire(void) {
+    if (jfd < 0)
+        return;
+    journal_pending = 0;
+    memset(journal_block, 0, sizeof(journal_block));
+    if (sd_seek(jfd, 0) == 0)
+        sd_write(jfd, journal_block, BLOCK_SIZE);
+    sd_flush(jfd);
+}
+
+/* goes through the journal once to see that it's complete, then again to write it into the image */
+static void journal_replay(void) {
+    if (!sd_exists(journal_path) || journal_open() != 0)
+        return;
+
+    int image_size = sd_filesize(fd);
+    uint32_t image_sectors = (image_size > 0) ? (uint32_t)image_size / BLOCK_SIZE : 0;
+
+    journal_rec_t rec;
+    if (journal_get(0, 0, &rec) != 0) {
+        sd_close(jfd);
+        jfd = -1;
+        return;
+    }
+
+    uint32_t gen = rec.gen;
+    uint32_t pos = 0, runs = 0;
+    int committed = 0;
+    while (journal_get(pos, gen, &rec) == 0) {
+        if (rec.type == JOURNAL_COMMIT) {
+            committed = (rec.count == runs);
+            break;
+        }
+        if (rec.type != JOURNAL_RUN || rec.count * BLOCK_SIZE > CHUNK_SIZE || !journal_rec_fits(&rec, image_sectors)
+            || ps2_cardman_journal_read(pos + BLOCK_SIZE, cardbuf, rec.count) != 0
+            || ps2_cardman_journal_sum(cardbuf, rec.count * BLOCK_SIZE) != rec.sum)
+            break;
+        pos += BLOCK_SIZE + rec.count * BLOCK_SIZE;
+        ++runs;
+    }
+
+    if (committed) {
+        printf("replaying journal, %u runs... ", (unsigned)runs);
+        if (journal_apply(gen, runs, image_sectors) != 0)
+            fatal("cannot replay journal");
+        printf("OK!\n");
+    } else {
+        printf("dropping incomplete journal\n");
+    }
+
+    ps2_cardman_journal_retire();
+}
+
 static void ensuredirs(void) {
     char cardpath[32];
     if (IDX_BOOT == card_idx)
@@ -206,6 +436,102 @@ static void genblock(size_t pos, void *vbuf) {
     }
 }
 
+static void resident_evict(int i) {
+    if (resident[i].size) {
+        psram_forget(i * RESIDENT_SIZE, resident[i].size);
+        resident[i].size = 0;
+    }
+}
+
+static int resident_find(void) {
+    for (int i = 0; i < NUM_RESIDENT; ++i)
+        if (resident[i].size && resident[i].idx == card_idx && resident[i].chan == card_chan)
+            return i;
+    return -1;
+}
+
+/* the least recently used slot that holds a card, -1 if there's none but skip */
+static int resident_lru(int skip) {
+    int best = -1;
+    for (int i = 0; i < NUM_RESIDENT; ++i) {
+        if (i == skip || !resident[i].size)
+            continue;
+        if (best < 0 || resident[i].last_use < resident[best].last_use)
+            best = i;
+    }
+    return best;
+}
+
+/* an empty one if there is any, otherwise the least recently used */
+static int resident_oldest(void) {
+    for (int i = 0; i < NUM_RESIDENT; ++i)
+        if (!resident[i].size)
+            return i;
+    return resident_lru(-1);
+}
+
+/* makes room for the card about to be loaded, sets the map base to where it goes */
+static void resident_place(uint32_t size) {
+    int slot = 0;
+
+    if (size > RESIDENT_SIZE) {
+        for (int i = 0; i < NUM_RESIDENT; ++i)
+            resident_evict(i);
+    } else {
+        /* a big card covers everything after it */
+        if (resident[0].size > RESIDENT_SIZE)
+            resident_evict(0);
+        slot = resident_oldest();
+        resident_evict(slot);
+        /* even if none of the new card is 0xFF it has to fit. once nothing else is loaded, whatever
+           still doesn't fit gets dropped on load and the open fails there */
+        while (psram_get_free_bytes() < size) {
+            int victim = resident_lru(slot);
+            if (victim < 0)
+                break;
+            resident_evict(victim);
+        }
+    }
+
+    resident[slot].idx = card_idx;
+    resident[slot].chan = card_chan;
+    resident[slot].size = size;
+    resident[slot].last_use = ++use_clock;
+    psram_set_base(slot * RESIDENT_SIZE);
+}
+
+/* already in psram? then the file only has to be opened again */
+static int resident_reopen(const char *path) {
+    int slot = resident_find();
+    if (slot < 0)
+        return 0;
+
+    if (sd_exists(path)) {
+        fd = sd_open(path, O_RDWR);
+        if (fd >= 0 && (uint32_t)sd_filesize(fd) == resident[slot].size) {
+            /* psram is ahead of the image anyway, but a journal left behind must not get written over */
+            journal_replay();
+            card_size = resident[slot].size;
+            resident[slot].last_use = ++use_clock;
+            psram_set_base(slot * RESIDENT_SIZE);
+            printf("card is still loaded\n");
+            return 1;
+        }
+        if (fd >= 0)
+            sd_close(fd);
+        fd = -1;
+    }
+
+    resident_evict(slot);
+    return 0;
+}
+
+void ps2_cardman_evict_all(void) {
+    for (int i = 0; i < NUM_RESIDENT; ++i)
+        resident[i].size = 0;
+    psram_forget_all();
+}
+
 void ps2_cardman_open(void) {
     char path[64];
 
@@ -221,6 +547,18 @@ void ps2_cardman_open(void) {
 
     printf("Switching to card path = %s\n", path);
 
+    /* Card1-1.mcd keeps its journal in Card1-1.jnl */
+    snprintf(journal_path, sizeof(journal_path), "%.*s.jnl", (int)(strlen(path) - 4), path);
+
+    /* a write got dropped since the last open, so what's loaded isn't what the console last saw -
+       the images on sd are at least consistent, load from there again */
+    if (psram_get_dropped_sectors()) {
+        ps2_cardman_evict_all();
+        psram_clear_dropped();
+    }
+
+    if (resident_reopen(path))
+        return;
 
     if (!sd_exists(path)) {
         cardprog_wr = 1;
@@ -229,17 +567,25 @@ void ps2_cardman_open(void) {
         if (fd < 0)
             fatal("cannot open for creating new card");
 
+        /* whatever a card that was here before left behind doesn't belong to this one */
+        if (sd_exists(journal_path) && journal_open() == 0)
+            ps2_cardman_journal_retire();
+
         printf("create new image at %s... ", path);
+        card_size = PS2_DEFAULT_CARD_SIZE;
+        resident_place(card_size);
         cardprog_start = time_us_64();
 
-        for (size_t pos = 0; pos < PS2_DEFAULT_CARD_SIZE; pos += BLOCK_SIZE) {
-            if (PS2_DEFAULT_CARD_SIZE == PS2_CARD_SIZE_8M)
-                genblock(pos, flushbuf);
-            else
-                memset(flushbuf, 0xFF, sizeof(flushbuf)/sizeof(flushbuf[0]));
-            if (sd_write(fd, flushbuf, BLOCK_SIZE) != BLOCK_SIZE)
+        for (size_t pos = 0; pos < PS2_DEFAULT_CARD_SIZE; pos += CHUNK_SIZE) {
+            for (size_t off = 0; off < CHUNK_SIZE; off += BLOCK_SIZE) {
+                if (PS2_DEFAULT_CARD_SIZE == PS2_CARD_SIZE_8M)
+                    genblock(pos + off, cardbuf + off);
+                else
+                    memset(cardbuf + off, 0xFF, BLOCK_SIZE);
+            }
+            if (sd_write(fd, cardbuf, CHUNK_SIZE) != (int)CHUNK_SIZE)
                 fatal("cannot init memcard");
-            psram_write(pos, flushbuf, BLOCK_SIZE);
+            psram_write_bulk(pos, cardbuf, CHUNK_SIZE);
             cardprog_pos = pos;
 
             if (cardman_cb)
@@ -259,26 +605,33 @@ void ps2_cardman_open(void) {
         if (fd < 0)
             fatal("cannot open card");
 
+        journal_replay();
+
         card_size = sd_filesize(fd);
         if ((card_size != PS2_CARD_SIZE_512K)
             && (card_size != PS2_CARD_SIZE_1M)
             && (card_size != PS2_CARD_SIZE_2M)
             && (card_size != PS2_CARD_SIZE_4M)
-            && (card_size != PS2_CARD_SIZE_8M))
+            && (card_size != PS2_CARD_SIZE_8M)
+            && (card_size != PS2_CARD_SIZE_16M))
             fatal("Card %d Channel %d is corrupted", card_idx, card_chan);
 
-        /* read 8 megs of card image */
+        /* read the card image, sectors that are all 0xFF don't take up psram */
         printf("reading card (%lu KB).... ", (uint32_t)(card_size / 1024));
+        resident_place(card_size);
+        uint32_t dropped = psram_get_dropped_sectors();
         cardprog_start = time_us_64();
-        for (size_t pos = 0; pos < card_size; pos += BLOCK_SIZE) {
-            if (sd_read(fd, flushbuf, BLOCK_SIZE) != BLOCK_SIZE)
+        for (size_t pos = 0; pos < card_size; pos += CHUNK_SIZE) {
+            if (sd_read(fd, cardbuf, CHUNK_SIZE) != (int)CHUNK_SIZE)
                 fatal("cannot read memcard");
-            psram_write(pos, flushbuf, BLOCK_SIZE);
+            psram_write_bulk(pos, cardbuf, CHUNK_SIZE);
             cardprog_pos = pos;
 
             if (cardman_cb)
                 cardman_cb(100 * pos / card_size);
         }
+        if (psram_get_dropped_sectors() != dropped)
+            fatal("Card %d Channel %d doesn't fit in PSRAM", card_idx, card_chan);
         uint64_t end = time_us_64();
         printf("OK!\n");
 
@@ -288,6 +641,14 @@ void ps2_cardman_open(void) {
 }
 
 void ps2_cardman_close(void) {
+    if (jfd >= 0) {
+        /* if it still can't be applied it stays on sd and the next full open replays it */
+        if (fd >= 0)
+            journal_settle();
+        journal_pending = 0;
+        sd_close(jfd);
+        jfd = -1;
+    }
     if (fd < 0)
         return;
     ps2_cardman_flush();
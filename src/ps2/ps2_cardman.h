@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 
+#define PS2_CARD_SIZE_16M       (16 * 1024 * 1024)
 #define PS2_CARD_SIZE_8M        (8 * 1024 * 1024)
 #define PS2_CARD_SIZE_4M        (4 * 1024 * 1024)
 #define PS2_CARD_SIZE_2M        (2 * 1024 * 1024)
@@ -10,9 +11,19 @@
 
 void ps2_cardman_init(void);
 int ps2_cardman_write_sector(int sector, void *buf512);
+int ps2_cardman_write_sectors(int sector, void *buf, uint32_t count);
 void ps2_cardman_flush(void);
+
+/* journaled write-back, see ps2_cardman.c - offsets are into the journal file */
+uint32_t ps2_cardman_journal_sum(const void *buf, uint32_t sz);
+int ps2_cardman_journal_begin(void);
+int ps2_cardman_journal_append(int sector, void *buf, uint32_t count, uint32_t sum, uint32_t *pos);
+int ps2_cardman_journal_commit(void);
+int ps2_cardman_journal_read(uint32_t pos, void *buf, uint32_t count);
+void ps2_cardman_journal_retire(void);
 void ps2_cardman_open(void);
 void ps2_cardman_close(void);
+void ps2_cardman_evict_all(void);
 int ps2_cardman_get_idx(void);
 int ps2_cardman_get_channel(void);
 uint32_t ps2_cardman_get_card_size(void);
@@ -1,124 +1,407 @@
 #include "ps2_dirty.h"
 #include "ps2_psram.h"
 #include "ps2_cardman.h"
+#include "settings.h"
 
 #include "bigmem.h"
-#define dirty_heap bigmem.ps2.dirty_heap
 #define dirty_map bigmem.ps2.dirty_map
+/* flushes go through the bulk buffer, card loads and psram tests never run alongside them */
+#define flushbuf bigmem.ps2.bulk_buf
 
 #include <stdio.h>
 
-spin_lock_t *ps2_dirty_spin_lock;
-volatile uint32_t ps2_dirty_lockout;
+uint32_t ps2_dirty_ring[PS2_DIRTY_RING];
+volatile uint32_t ps2_dirty_ring_head, ps2_dirty_ring_tail, ps2_dirty_ring_full;
+volatile uint32_t ps2_dirty_last_access;
+volatile uint32_t ps2_dirty_gap_us = 100 * 1000;
 int ps2_dirty_activity;
 
+/* everything from here on is core0's own */
 static int num_dirty;
+static uint32_t max_lag_ms;
+static uint32_t urgent_flushes;
+/* sectors a drain still has to write, for its progress text */
+static int drain_left;
 
-#define SWAP(a, b) do { \
-    uint16_t tmp = a; \
-    a = b; \
-    b = tmp; \
-} while (0);
+/*
+ * Flushing waits until the console has been quiet for SETTLE_US, so a save that's still going gets
+ * written out in one go. From there the learned gap says how much longer the card should be left
+ * alone, and a flush gets most of that. If too much piles up or it waits too long because the
+ * console never stops, it goes ahead anyway in small steps.
+ */
+#define SETTLE_US (10 * 1000)
+#define BUDGET_MIN_US (5 * 1000)
+#define BUDGET_MAX_US (100 * 1000)
+#define URGENT_BUDGET_US (10 * 1000)
+#define URGENT_SECTORS 256
+#define URGENT_AGE_US (2 * 1000 * 1000)
+
+#define MAP_WORDS (sizeof(dirty_map) / sizeof(*dirty_map))
+/* a bit per word of dirty_map that has anything set, so the lowest dirty sector is two ctz away */
+static uint32_t dirty_summary[MAP_WORDS / 32];
+/* when each word of dirty_map last went from clean to dirty, in us. a word that got flushed in
+   part keeps its stamp, so the age of the oldest dirty sector errs on the old side */
+static uint32_t dirty_stamp[MAP_WORDS];
+
+/* longest a run may be, and what a sector is expected to take from psram to sd until the real
+   time is known */
+#define RUN_MAX (sizeof(flushbuf) / 512)
+#define SECTOR_COST_INIT_US 1000
+/* learned time per sector of a run, so the runs fit into the budget */
+static uint32_t sector_cost_us = SECTOR_COST_INIT_US;
 
 void ps2_dirty_init(void) {
-    ps2_dirty_spin_lock = spin_lock_init(spin_lock_claim_unused(1));
+    ps2_dirty_ring_head = ps2_dirty_ring_tail = 0;
 }
 
-void __time_critical_func(ps2_dirty_mark)(uint32_t sector) {
-    if (sector < sizeof(dirty_map)) {
+static void map_mark(uint32_t sector) {
+    uint32_t word = sector / 32, bit = 1u << (sector % 32);
+    if (word < MAP_WORDS) {
         /* already marked? */
-        if (dirty_map[sector])
+        if (dirty_map[word] & bit)
             return;
 
-        /* update map */
-        dirty_map[sector] = 1;
+        if (!dirty_map[word])
+            dirty_stamp[word] = (uint32_t)time_us_64();
+        dirty_map[word] |= bit;
+        dirty_summary[word / 32] |= 1u << (word % 32);
+        ++num_dirty;
+    }
+}
 
-        /* update heap */
-        int cur = num_dirty++;
-        dirty_heap[cur] = sector;
-        while (dirty_heap[cur] < dirty_heap[(cur-1)/2]) {
-            SWAP(dirty_heap[cur], dirty_heap[(cur-1)/2]);
-            cur = (cur-1)/2;
-        }
+static void map_mark_range(uint32_t sector, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i)
+        map_mark(sector + i);
+}
+
+/* takes in everything core1 marked so far */
+static void ring_drain(void) {
+    uint32_t head = ps2_dirty_ring_head;
+    __mem_fence_acquire();
+    for (uint32_t tail = ps2_dirty_ring_tail; tail != head; ++tail) {
+        uint32_t rec = ps2_dirty_ring[tail % PS2_DIRTY_RING];
+        map_mark_range(rec & 0xFFFFFF, rec >> 24);
     }
+    __mem_fence_release();
+    ps2_dirty_ring_tail = head;
 }
 
-static void heapify(int i) {
-    int l = i * 2 + 1;
-    int r = i * 2 + 2;
-    int best = i;
-    if (l < num_dirty && dirty_heap[l] < dirty_heap[best])
-        best = l;
-    if (r < num_dirty && dirty_heap[r] < dirty_heap[best])
-        best = r;
-    if (best != i) {
-        SWAP(dirty_heap[i], dirty_heap[best]);
-        heapify(best);
+static inline void clear_bits(uint32_t word, uint32_t mask) {
+    dirty_map[word] &= ~mask;
+    if (!dirty_map[word])
+        dirty_summary[word / 32] &= ~(1u << (word % 32));
+}
+
+static int lowest_word(void) {
+    for (uint32_t i = 0; i < count_of(dirty_summary); ++i)
+        if (dirty_summary[i])
+            return i * 32 + __builtin_ctz(dirty_summary[i]);
+    return -1;
+}
+
+/* how long the oldest dirty sector has been waiting, 0 if there's none */
+static uint32_t dirty_age_us(uint32_t now) {
+    uint32_t age = 0;
+    for (uint32_t i = 0; i < count_of(dirty_summary); ++i) {
+        for (uint32_t bits = dirty_summary[i]; bits; bits &= bits - 1) {
+            uint32_t word = i * 32 + __builtin_ctz(bits);
+            if (now - dirty_stamp[word] > age)
+                age = now - dirty_stamp[word];
+        }
     }
+    return age;
 }
 
-int ps2_dirty_get_marked(void) {
-    if (num_dirty == 0)
+/* takes the lowest run of consecutive dirty sectors, at most max of them, and unmarks it. runs come
+   out lowest first, so the flush walks the card image front to back */
+int ps2_dirty_get_run(uint32_t max, uint32_t *count) {
+    ring_drain();
+
+    int word = lowest_word();
+    if (word < 0)
         return -1;
 
-    uint16_t ret = dirty_heap[0];
+    uint32_t first = word * 32 + __builtin_ctz(dirty_map[word]);
+    uint32_t sector = first;
+    *count = 0;
+    while (*count < max && sector / 32 < MAP_WORDS) {
+        word = sector / 32;
+        /* the ones from here on in this word, up to the first clean sector */
+        uint32_t bits = dirty_map[word] >> (sector % 32);
+        uint32_t len = (bits == UINT32_MAX) ? 32 : __builtin_ctz(~bits);
+        if (len > 32 - sector % 32)
+            len = 32 - sector % 32;
+        if (len > max - *count)
+            len = max - *count;
+        if (len == 0)
+            break;
+
+        uint32_t mask = (len == 32) ? UINT32_MAX : ((1u << len) - 1) << (sector % 32);
+        clear_bits(word, mask);
+        *count += len;
+        sector += len;
+        /* the run goes on into the next word only if this one was dirty to its end */
+        if (sector % 32)
+            break;
+    }
+    num_dirty -= *count;
+
+    return first;
+}
+
+/* how long the flush may take right now, 0 if it should wait. urgent is set if it can't wait for
+   the console to settle */
+static uint32_t flush_budget(int *urgent) {
+    uint32_t now = (uint32_t)time_us_64();
+    uint32_t quiet = now - ps2_dirty_last_access;
+    uint32_t gap = ps2_dirty_gap_us;
 
-    /* update heap */
-    dirty_heap[0] = dirty_heap[--num_dirty];
-    heapify(0);
+    if (quiet >= SETTLE_US) {
+        /* most of what's left of the gap, the rest is margin for a console that's early */
+        uint32_t budget = (gap > quiet) ? (gap - quiet) * 3 / 4 : 0;
+        if (budget < BUDGET_MIN_US)
+            budget = BUDGET_MIN_US;
+        if (budget > BUDGET_MAX_US)
+            budget = BUDGET_MAX_US;
+        return budget;
+    }
 
-    /* update map */
-    dirty_map[ret] = 0;
+    if (num_dirty >= URGENT_SECTORS || (num_dirty && dirty_age_us(now) >= URGENT_AGE_US)) {
+        *urgent = 1;
+        return URGENT_BUDGET_US;
+    }
 
-    return ret;
+    return 0;
 }
 
-/* this goes through blocks in psram marked as dirty and flushes them to sd */
-void ps2_dirty_task(void) {
-    static uint8_t flushbuf[512];
+static void remark(uint32_t sector, uint32_t count) {
+    map_mark_range(sector, count);
+}
 
-    int num_after = 0;
+/* a sector whose write got dropped because psram was full reads as 0xFF, and that must not go over
+   what the image has. called once the run is read, when any write queued before it has been placed;
+   cuts the run short before the first lost sector, unmarks that one and leaves the rest for later */
+static uint32_t run_trim_lost(uint32_t sector, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (psram_sector_lost((sector + i) * 512)) {
+            printf("!! sector 0x%x didn't fit in psram, not flushing it\n", (unsigned)(sector + i));
+            remark(sector + i + 1, count - i - 1);
+            return i;
+        }
+    }
+    return count;
+}
+
+/* how many sectors of cost each fit into what's left of the budget */
+static uint32_t run_limit(uint64_t start, uint32_t budget, uint32_t cost) {
+    uint32_t spent = (uint32_t)(time_us_64() - start);
+    uint32_t max = (spent < budget) ? (budget - spent) / cost : 0;
+    return (max > RUN_MAX) ? RUN_MAX : max;
+}
+
+static void learn_cost(uint64_t run_start, uint32_t count) {
+    uint32_t per_sector = (uint32_t)(time_us_64() - run_start) / count;
+    sector_cost_us = sector_cost_us - sector_cost_us / 8 + per_sector / 8;
+    if (!sector_cost_us)
+        sector_cost_us = 1;
+}
+
+/* every run straight into the image */
+static int flush_direct(uint64_t start, uint32_t budget) {
     int hit = 0;
-    uint64_t start = time_us_64();
+
     while (1) {
-        if (!ps2_dirty_lockout_expired())
-            break;
-        /* do up to 100ms of work per call to dirty_taks */
-        if ((time_us_64() - start) > 100 * 1000)
+        uint32_t max = run_limit(start, budget, sector_cost_us);
+        /* the first run always gets a sector out, a card slower than any budget still gets flushed */
+        if (!max) {
+            if (hit)
+                break;
+            max = 1;
+        }
+
+        uint64_t run_start = time_us_64();
+        uint32_t count;
+        int sector = ps2_dirty_get_run(max, &count);
+        if (sector == -1)
             break;
+        /* writes get queued before their sector is marked, so this reads whatever was last marked.
+           one coming in after get_run marks the sector again, so it just gets flushed twice */
+        psram_read_bulk(sector * 512, flushbuf, count * 512);
+        count = run_trim_lost(sector, count);
+        if (!count)
+            continue;
 
-        ps2_dirty_lock();
-        int sector = ps2_dirty_get_marked();
-        num_after = num_dirty;
-        if (sector == -1) {
-            ps2_dirty_unlock();
+        if (ps2_cardman_write_sectors(sector, flushbuf, count) != 0) {
+            // TODO: do something if we get too many errors?
+            // for now lets mark them again and try again later
+            printf("!! writing sectors 0x%x-0x%x failed\n", sector, (unsigned)(sector + count - 1));
+            remark(sector, count);
             break;
         }
-        psram_read(sector * 512, flushbuf, 512);
-        ps2_dirty_unlock();
 
-        ++hit;
+        learn_cost(run_start, count);
+        hit += count;
+    }
 
-        if (ps2_cardman_write_sector(sector, flushbuf) != 0) {
-            // TODO: do something if we get too many errors?
-            // for now lets push it back into the heap and try again later
-            printf("!! writing sector 0x%x failed\n", sector);
+    return hit;
+}
+
+typedef struct {
+    uint32_t sector, count;
+    uint32_t sum; /* of the data as it went into the journal */
+    uint32_t pos; /* of that data in the journal */
+} journal_run_t;
+
+#define JOURNAL_RUNS 32
 
-            ps2_dirty_lock();
-            ps2_dirty_mark(sector);
-            ps2_dirty_unlock();
+/* all the runs into the journal and commit it, then into the image */
+static int flush_journaled(uint64_t start, uint32_t budget) {
+    static journal_run_t runs[JOURNAL_RUNS];
+    int num = 0, hit = 0;
+
+    if (ps2_cardman_journal_begin() != 0) {
+        printf("!! cannot open the journal\n");
+        return 0;
+    }
+
+    while (num < JOURNAL_RUNS) {
+        /* every sector goes to sd twice, into the journal and then into the image */
+        uint32_t max = run_limit(start, budget, 2 * sector_cost_us);
+        if (!max) {
+            if (num)
+                break;
+            max = 1;
         }
+
+        journal_run_t *run = &runs[num];
+        int sector = ps2_dirty_get_run(max, &run->count);
+        if (sector == -1)
+            break;
+        run->sector = sector;
+
+        psram_read_bulk(run->sector * 512, flushbuf, run->count * 512);
+        run->count = run_trim_lost(run->sector, run->count);
+        if (!run->count)
+            continue;
+        ++num;
+        run->sum = ps2_cardman_journal_sum(flushbuf, run->count * 512);
+        if (ps2_cardman_journal_append(run->sector, flushbuf, run->count, run->sum, &run->pos) != 0)
+            goto fail;
+    }
+    if (!num)
+        return 0;
+    if (ps2_cardman_journal_commit() != 0)
+        goto fail;
+
+    /* psram is quicker to read than the journal, unless the console changed a run since */
+    for (int i = 0; i < num; ++i) {
+        journal_run_t *run = &runs[i];
+        uint64_t run_start = time_us_64();
+        psram_read_bulk(run->sector * 512, flushbuf, run->count * 512);
+        if (ps2_cardman_journal_sum(flushbuf, run->count * 512) != run->sum
+            && ps2_cardman_journal_read(run->pos, flushbuf, run->count) != 0)
+            goto fail;
+        if (ps2_cardman_write_sectors(run->sector, flushbuf, run->count) != 0)
+            goto fail;
+        learn_cost(run_start, run->count);
+        hit += run->count;
     }
-    /* to make sure writes hit the storage medium */
     ps2_cardman_flush();
+    ps2_cardman_journal_retire();
 
-    uint64_t end = time_us_64();
+    return hit;
+
+fail:
+    // TODO: same as above, try again later
+    printf("!! journaled flush of %d runs failed\n", num);
+    for (int i = 0; i < num; ++i)
+        remark(runs[i].sector, runs[i].count);
+    return 0;
+}
+
+/* this goes through blocks in psram marked as dirty and flushes them to sd, in the console's idle gaps */
+void ps2_dirty_task(void) {
+    int hit = 0, urgent = 0;
+    uint64_t start = time_us_64();
+    ring_drain();
+    uint32_t budget = num_dirty ? flush_budget(&urgent) : 0;
+    /* how long the oldest dirty sector had been waiting when the pass started */
+    uint32_t age_us = budget ? dirty_age_us((uint32_t)start) : 0;
+    int journaled = settings_get_ps2_journal();
 
-    if (hit)
-        printf("remain to flush - %d - this one flushed %d and took %d ms\n", num_after, hit, (int)((end - start) / 1000));
+    if (budget)
+        hit = journaled ? flush_journaled(start, budget) : flush_direct(start, budget);
 
-    if (num_after || !ps2_dirty_lockout_expired())
+    int num_after = num_dirty;
+    if (hit) {
+        /* to make sure writes hit the storage medium - the journaled flush did already, before
+           it retired the journal */
+        if (!journaled)
+            ps2_cardman_flush();
+        if (urgent)
+            ++urgent_flushes;
+
+        uint64_t end = time_us_64();
+        uint32_t lag_ms = (age_us + (uint32_t)(end - start)) / 1000;
+        if (!num_after && lag_ms > max_lag_ms)
+            max_lag_ms = lag_ms;
+        printf("remain to flush - %d - this one flushed %d and took %d ms of %d, lag %d ms\n", num_after, hit,
+            (int)((end - start) / 1000), (int)(budget / 1000), (int)lag_ms);
+    }
+
+    if (num_after || (uint32_t)time_us_64() - ps2_dirty_last_access < SETTLE_US)
         ps2_dirty_activity = 1;
     else
         ps2_dirty_activity = 0;
 }
+
+void ps2_dirty_get_stats(ps2_dirty_stats_t *stats) {
+    stats->dirty = num_dirty;
+    stats->lag_ms = dirty_age_us((uint32_t)time_us_64()) / 1000;
+    stats->max_lag_ms = max_lag_ms;
+    stats->gap_us = ps2_dirty_gap_us;
+    stats->urgent = urgent_flushes;
+    stats->ring_full = ps2_dirty_ring_full;
+}
+
+/* how long each step of a drain gets, between progress updates */
+#define DRAIN_STEP_US (20 * 1000)
+
+void ps2_dirty_drain(ps2_dirty_cb_t cb) {
+    ring_drain();
+    int total = num_dirty;
+    if (!total)
+        return;
+
+    printf("draining %d dirty sectors... ", total);
+    /* the progress text is up before the first step is done */
+    drain_left = total;
+    if (cb)
+        cb(0);
+    uint64_t start = time_us_64();
+    int journaled = settings_get_ps2_journal();
+    while (num_dirty) {
+        int hit = journaled ? flush_journaled(time_us_64(), DRAIN_STEP_US) : flush_direct(time_us_64(), DRAIN_STEP_US);
+        /* sd keeps failing, the sectors stay marked for the next try */
+        if (!hit)
+            break;
+        drain_left = num_dirty;
+        if (cb)
+            cb(100 * (total - drain_left) / total);
+    }
+    /* each journaled step synced before retiring its journal */
+    if (!journaled)
+        ps2_cardman_flush();
+
+    uint64_t end = time_us_64();
+    printf("%s, took %d ms\n", num_dirty ? "FAILED" : "OK!", (int)((end - start) / 1000));
+    ps2_dirty_activity = (num_dirty != 0);
+}
+
+char *ps2_dirty_get_progress_text(void) {
+    static char progress[32];
+
+    snprintf(progress, sizeof(progress), "Saving %d", drain_left);
+
+    return progress;
+}
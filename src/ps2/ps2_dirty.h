@@ -7,29 +7,76 @@
 
 #include "util.h"
 
-extern spin_lock_t *ps2_dirty_spin_lock;
-extern volatile uint32_t ps2_dirty_lockout;
+/* low 32 bits of the time in us of the last card access, and the learned time the console
+   leaves the card alone between its bursts of commands */
+extern volatile uint32_t ps2_dirty_last_access;
+extern volatile uint32_t ps2_dirty_gap_us;
 
-static inline void __time_critical_func(ps2_dirty_lock)(void) {
-    spin_lock_unsafe_blocking(ps2_dirty_spin_lock);
-}
+/* commands closer together than this belong to the same burst */
+#define PS2_DIRTY_BURST_GAP_US (2 * 1000)
+/* longer breaks are counted as this much, a console that sat idle says nothing about its next gap */
+#define PS2_DIRTY_GAP_MAX_US (1000 * 1000)
+
+/*
+ * Core1 hands dirty sectors to core0 through a single producer/single consumer ring, core0 merges
+ * them into its own map before every flush step. Nothing is shared beyond the ring, so marking
+ * a sector never waits on the flush.
+ */
+#define PS2_DIRTY_RING 1024
 
-static inline void __time_critical_func(ps2_dirty_unlock)(void) {
-    spin_unlock_unsafe(ps2_dirty_spin_lock);
+extern uint32_t ps2_dirty_ring[PS2_DIRTY_RING];
+extern volatile uint32_t ps2_dirty_ring_head, ps2_dirty_ring_tail, ps2_dirty_ring_full;
+
+/* core1 only - count sectors starting at sector need flushing. a mark can't be dropped, so if
+   core0 fell a whole ring behind this waits for it, ps2_dirty_ring_full counts how often */
+static inline void __time_critical_func(ps2_dirty_mark_range)(uint32_t sector, uint32_t count) {
+    uint32_t head = ps2_dirty_ring_head;
+    if (head - ps2_dirty_ring_tail >= PS2_DIRTY_RING) {
+        ++ps2_dirty_ring_full;
+        while (head - ps2_dirty_ring_tail >= PS2_DIRTY_RING)
+            tight_loop_contents();
+    }
+    ps2_dirty_ring[head % PS2_DIRTY_RING] = (count << 24) | sector;
+    __mem_fence_release();
+    ps2_dirty_ring_head = head + 1;
 }
 
-static inline void __time_critical_func(ps2_dirty_lockout_renew)(void) {
-    /* lockout for 100ms, store time in ms */
-    ps2_dirty_lockout = (uint32_t)(RAM_time_us_64() / 1000) + 100;
+static inline void __time_critical_func(ps2_dirty_mark)(uint32_t sector) {
+    ps2_dirty_mark_range(sector, 1);
 }
 
-static inline int __time_critical_func(ps2_dirty_lockout_expired)(void) {
-    return ps2_dirty_lockout < (uint32_t)(RAM_time_us_64() / 1000);
+/* core1 - called on every card access, the flush runs in the gaps between them */
+static inline void __time_critical_func(ps2_dirty_note_access)(void) {
+    uint32_t now = (uint32_t)RAM_time_us_64();
+    uint32_t gap = now - ps2_dirty_last_access;
+    if (gap > PS2_DIRTY_BURST_GAP_US) {
+        if (gap > PS2_DIRTY_GAP_MAX_US)
+            gap = PS2_DIRTY_GAP_MAX_US;
+        ps2_dirty_gap_us = ps2_dirty_gap_us - ps2_dirty_gap_us / 8 + gap / 8;
+    }
+    ps2_dirty_last_access = now;
 }
 
+typedef struct {
+    uint32_t dirty;      /* sectors still to flush */
+    uint32_t lag_ms;     /* how long the oldest of them has been waiting */
+    uint32_t max_lag_ms; /* longest it took from the first mark until everything was on sd */
+    uint32_t gap_us;     /* learned idle time between the console's bursts */
+    uint32_t urgent;     /* flushes that went ahead without waiting for a gap */
+    uint32_t ring_full;  /* times core1 had to wait for room in the ring */
+} ps2_dirty_stats_t;
+
+void ps2_dirty_get_stats(ps2_dirty_stats_t *stats);
+
 void ps2_dirty_init(void);
-int ps2_dirty_get_marked(void);
-void ps2_dirty_mark(uint32_t sector);
+int ps2_dirty_get_run(uint32_t max, uint32_t *count);
 void ps2_dirty_task(void);
 
+typedef void (*ps2_dirty_cb_t)(int);
+
+/* writes out every dirty sector before returning, flat out with no waiting for gaps - for card
+   switches and mode changes, the card has to be exited first. cb gets the progress in percent */
+void ps2_dirty_drain(ps2_dirty_cb_t cb);
+char *ps2_dirty_get_progress_text(void);
+
 extern int ps2_dirty_activity;
@@ -0,0 +1,69 @@
+#include "ps2_ecc.h"
+
+#include "pico/platform.h"
+
+static uint8_t EccTable[] = {
+	0x00, 0x87, 0x96, 0x11, 0xa5, 0x22, 0x33, 0xb4,0xb4, 0x33, 0x22, 0xa5, 0x11, 0x96, 0x87, 0x00,
+	0xc3, 0x44, 0x55, 0xd2, 0x66, 0xe1, 0xf0, 0x77,0x77, 0xf0, 0xe1, 0x66, 0xd2, 0x55, 0x44, 0xc3,
+	0xd2, 0x55, 0x44, 0xc3, 0x77, 0xf0, 0xe1, 0x66,0x66, 0xe1, 0xf0, 0x77, 0xc3, 0x44, 0x55, 0xd2,
+	0x11, 0x96, 0x87, 0x00, 0xb4, 0x33, 0x22, 0xa5,0xa5, 0x22, 0x33, 0xb4, 0x00, 0x87, 0x96, 0x11,
+	0xe1, 0x66, 0x77, 0xf0, 0x44, 0xc3, 0xd2, 0x55,0x55, 0xd2, 0xc3, 0x44, 0xf0, 0x77, 0x66, 0xe1,
+	0x22, 0xa5, 0xb4, 0x33, 0x87, 0x00, 0x11, 0x96,0x96, 0x11, 0x00, 0x87, 0x33, 0xb4, 0xa5, 0x22,
+	0x33, 0xb4, 0xa5, 0x22, 0x96, 0x11, 0x00, 0x87,0x87, 0x00, 0x11, 0x96, 0x22, 0xa5, 0xb4, 0x33,
+	0xf0, 0x77, 0x66, 0xe1, 0x55, 0xd2, 0xc3, 0x44,0x44, 0xc3, 0xd2, 0x55, 0xe1, 0x66, 0x77, 0xf0,
+	0xf0, 0x77, 0x66, 0xe1, 0x55, 0xd2, 0xc3, 0x44,0x44, 0xc3, 0xd2, 0x55, 0xe1, 0x66, 0x77, 0xf0,
+	0x33, 0xb4, 0xa5, 0x22, 0x96, 0x11, 0x00, 0x87,0x87, 0x00, 0x11, 0x96, 0x22, 0xa5, 0xb4, 0x33,
+	0x22, 0xa5, 0xb4, 0x33, 0x87, 0x00, 0x11, 0x96,0x96, 0x11, 0x00, 0x87, 0x33, 0xb4, 0xa5, 0x22,
+	0xe1, 0x66, 0x77, 0xf0, 0x44, 0xc3, 0xd2, 0x55,0x55, 0xd2, 0xc3, 0x44, 0xf0, 0x77, 0x66, 0xe1,
+	0x11, 0x96, 0x87, 0x00, 0xb4, 0x33, 0x22, 0xa5,0xa5, 0x22, 0x33, 0xb4, 0x00, 0x87, 0x96, 0x11,
+	0xd2, 0x55, 0x44, 0xc3, 0x77, 0xf0, 0xe1, 0x66,0x66, 0xe1, 0xf0, 0x77, 0xc3, 0x44, 0x55, 0xd2,
+	0xc3, 0x44, 0x55, 0xd2, 0x66, 0xe1, 0xf0, 0x77,0x77, 0xf0, 0xe1, 0x66, 0xd2, 0x55, 0x44, 0xc3,
+	0x00, 0x87, 0x96, 0x11, 0xa5, 0x22, 0x33, 0xb4,0xb4, 0x33, 0x22, 0xa5, 0x11, 0x96, 0x87, 0x00
+};
+
+/* for each 4-bit mask of byte lanes with odd parity: xor of the lane numbers (bits 0-1) and parity of the lane count (bit 2) */
+static uint8_t LaneTable[] = {
+    0x00, 0x04, 0x05, 0x01, 0x06, 0x02, 0x03, 0x07, 0x07, 0x03, 0x02, 0x06, 0x01, 0x05, 0x04, 0x00
+};
+
+static void __time_critical_func(ps2_ecc_chunk)(const uint8_t *data, uint8_t *ecc) {
+    const uint32_t *words = (const uint32_t *)data;
+    uint32_t col = 0;
+    uint8_t idx = 0;
+
+    for (uint32_t i = 0; i < PS2_ECC_CHUNK_SIZE / 4; ++i) {
+        uint32_t w = words[i];
+        col ^= w;
+
+        /* fold parity of every byte into bit 0 of its lane, then gather the 4 lane bits at the top */
+        w ^= w >> 4;
+        w ^= w >> 2;
+        w ^= w >> 1;
+        uint8_t lanes = LaneTable[((w & 0x01010101u) * 0x10204080u) >> 28];
+
+        /* xor of indices of all odd-parity bytes in this word */
+        idx ^= (uint8_t)(((-(lanes >> 2)) & (i << 2)) | (lanes & 3));
+    }
+
+    /* column parity is linear, so the table only needs to see the xor of all bytes */
+    col ^= col >> 16;
+    col ^= col >> 8;
+    uint8_t c = EccTable[col & 0xFF];
+
+    /* bit 7 is the parity of the whole chunk, i.e. how many times ~idx got folded into ecc[1] */
+    ecc[0] = ~c & 0x77;
+    ecc[1] = ((c & 0x80) ? idx : ~idx) & 0x7F;
+    ecc[2] = ~idx & 0x7F;
+}
+
+void __time_critical_func(ps2_ecc_sector)(const uint8_t *data, uint8_t *ecc) {
+    for (int i = 0; i < PS2_ECC_CHUNKS; ++i)
+        ps2_ecc_chunk(&data[i * PS2_ECC_CHUNK_SIZE], &ecc[i * 3]);
+
+    /* the byte-at-a-time encoder also folded the first ecc byte into the 4 spare bytes, keep that */
+    uint8_t c = EccTable[ecc[0]];
+    ecc[12] = c;
+    ecc[13] = (c & 0x80) ? 0xFF : 0x00;
+    ecc[14] = 0;
+    ecc[15] = 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <inttypes.h>
+
+#define PS2_ECC_CHUNK_SIZE 128
+#define PS2_ECC_CHUNKS 4
+
+/* computes the 16 byte spare area (3 ecc bytes per 128 byte chunk + 4 spare) of a 512 byte, word-aligned sector */
+void ps2_ecc_sector(const uint8_t *data, uint8_t *ecc);
@@ -0,0 +1,100 @@
+#include "ps2_mc_timing.h"
+
+#ifdef DEBUG_MC_TIMING
+
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+uint32_t ps2_mc_timing_ring[PS2_MC_TIMING_RING];
+volatile uint32_t ps2_mc_timing_head, ps2_mc_timing_tail, ps2_mc_timing_dropped;
+
+#define PRINT_INTERVAL_US (5 * 1000 * 1000)
+
+/* bucket n holds everything under 8us << n, the last one the rest */
+#define NUM_BUCKETS 12
+
+typedef struct {
+    const char *name;
+    uint8_t cmd;
+    uint32_t buckets[NUM_BUCKETS];
+    uint32_t count, worst;
+    uint8_t worst_sub;
+} histogram_t;
+
+static histogram_t histograms[] = {
+    { .name = "23 read addr", .cmd = 0x23 },
+    { .name = "42 write data", .cmd = 0x42 },
+    { .name = "43 read data", .cmd = 0x43 },
+    { .name = "81 commit", .cmd = 0x81 },
+    { .name = "82 erase", .cmd = 0x82 },
+    { .name = "F0 auth", .cmd = 0xF0 },
+    { .name = "other" },
+};
+
+#define NUM_HISTOGRAMS (sizeof(histograms)/sizeof(*histograms))
+
+static histogram_t *histogram_for(uint8_t cmd) {
+    for (size_t i = 0; i < NUM_HISTOGRAMS - 1; ++i)
+        if (histograms[i].cmd == cmd)
+            return &histograms[i];
+    return &histograms[NUM_HISTOGRAMS - 1];
+}
+
+static void file_record(uint32_t rec) {
+    uint8_t cmd = rec >> 24;
+    uint8_t sub = (rec >> 16) & 0xFF;
+    uint32_t us = rec & 0xFFFF;
+
+    histogram_t *h = histogram_for(cmd);
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS - 1 && us >= (8u << bucket))
+        ++bucket;
+    ++h->buckets[bucket];
+    ++h->count;
+    if (us >= h->worst) {
+        h->worst = us;
+        h->worst_sub = (cmd == 0xF0) ? sub : cmd;
+    }
+}
+
+static void print_histograms(void) {
+    printf("mc timing, buckets from <8us doubling up to >=%dus", 8 << (NUM_BUCKETS - 2));
+    if (ps2_mc_timing_dropped)
+        printf(", %d dropped", (int)ps2_mc_timing_dropped);
+    printf("\n");
+
+    for (size_t i = 0; i < NUM_HISTOGRAMS; ++i) {
+        histogram_t *h = &histograms[i];
+        if (!h->count)
+            continue;
+        printf("%-13s n=%-6d worst=%dus (%02X) |", h->name, (int)h->count, (int)h->worst, h->worst_sub);
+        for (int b = 0; b < NUM_BUCKETS; ++b)
+            printf(" %d", (int)h->buckets[b]);
+        printf("\n");
+    }
+}
+
+void ps2_mc_timing_task(void) {
+    static uint64_t last_print;
+    static int fresh;
+
+    uint32_t head = ps2_mc_timing_head;
+    __mem_fence_acquire();
+    for (uint32_t tail = ps2_mc_timing_tail; tail != head; ++tail) {
+        file_record(ps2_mc_timing_ring[tail % PS2_MC_TIMING_RING]);
+        fresh = 1;
+    }
+    ps2_mc_timing_tail = head;
+
+    uint64_t now = time_us_64();
+    if (fresh && now - last_print > PRINT_INTERVAL_US) {
+        print_histograms();
+        last_print = now;
+        fresh = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Per-command latency histograms, built with -DDEBUG_MC_TIMING (cmake -DDEBUG_MC_TIMING=ON).
+ *
+ * Core1 only drops a 4-byte record into a ring per transaction, core0 sorts them
+ * into histograms and prints them every few seconds - nothing slow happens in the protocol loop.
+ */
+
+#include <inttypes.h>
+
+#include "pico/platform.h"
+
+#ifdef DEBUG_MC_TIMING
+
+#define PS2_MC_TIMING_RING 256
+
+extern uint32_t ps2_mc_timing_ring[PS2_MC_TIMING_RING];
+extern volatile uint32_t ps2_mc_timing_head, ps2_mc_timing_tail, ps2_mc_timing_dropped;
+
+/* core1 only - sub is the MagicGate step for 0xF0, us saturates at 0xFFFF */
+static inline void __time_critical_func(ps2_mc_timing_record)(uint8_t cmd, uint8_t sub, uint32_t us) {
+    uint32_t head = ps2_mc_timing_head;
+    if (head - ps2_mc_timing_tail >= PS2_MC_TIMING_RING) {
+        ++ps2_mc_timing_dropped;
+        return;
+    }
+    if (us > 0xFFFF)
+        us = 0xFFFF;
+    ps2_mc_timing_ring[head % PS2_MC_TIMING_RING] = (cmd << 24) | (sub << 16) | us;
+    __mem_fence_release();
+    ps2_mc_timing_head = head + 1;
+}
+
+/* core0 - drain the ring, print the histograms now and then */
+void ps2_mc_timing_task(void);
+
+#else
+
+static inline void ps2_mc_timing_record(uint8_t cmd, uint8_t sub, uint32_t us) {
+    (void)cmd; (void)sub; (void)us;
+}
+
+static inline void ps2_mc_timing_task(void) {
+}
+
+#endif
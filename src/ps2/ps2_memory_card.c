@@ -17,6 +17,9 @@
 #include "ps2_pio_qspi.h"
 #include "ps2_cardman.h"
 #include "ps2_exploit.h"
+#include "ps2_ecc.h"
+#include "ps2_memory_card.h"
+#include "ps2_mc_timing.h"
 
 #include <stdbool.h>
 #include <string.h>
@@ -37,38 +40,156 @@ typedef struct {
     uint32_t sm;
 } pio_t;
 
-pio_t cmd_reader, dat_writer, dat_writer_slow, clock_probe;
+pio_t cmd_reader, dat_writer, clock_probe;
+static dma_channel_config stream_conf;
+
+typedef struct {
+    uint32_t khz;       /* fastest clock the profile is meant for */
+    uint32_t max_low;   /* clock_probe count the low phase of the first bit stays under */
+    bool timed;         /* too fast for the writer to follow the clock, send bits on a fixed schedule */
+} mc_clock_profile_t;
+
+/* clock_probe runs at the full 240MHz and counts in 2-cycle steps of ~8.3ns, so the low phase
+   is about 2.4 counts at 25MHz and 7.5 at 8MHz. the writer only has the two ways of sending, so
+   there's just the one threshold between those, with room for duty cycle skew and the input
+   synchronizer - 8MHz and everything slower get followed bit by bit */
+static mc_clock_profile_t mc_clock_profiles[] = {
+    { 25000, 5, true },
+    { 8000, UINT32_MAX, false },
+};
+static mc_clock_profile_t *volatile mc_clock = &mc_clock_profiles[count_of(mc_clock_profiles) - 1];
 
 #define ERASE_SECTORS 16
+/* sent instead of `term` when a command came in with a bad checksum */
+#define TERM_CK_ERROR 0x66
 #define CARD_SIZE (8 * 1024 * 1024)
 
 uint8_t term = 0xFF;
 uint32_t read_sector, write_sector, erase_sector;
-struct {
+
+#define NO_SECTOR UINT32_MAX
+
+typedef struct {
     uint32_t prefix;
     uint8_t buf[528];
-} readtmp;
-uint8_t *eccptr;
-uint8_t writetmp[528];
+    uint32_t sector;
+    volatile int landed, ecc_ready;
+    volatile int queued;    /* a psram read into this buffer hasn't finished yet */
+} readbuf_t;
+
+/* readtmp is what's being served to the console, readahead gets the following sector in the background */
+static readbuf_t readbufs[2] = { { .sector = NO_SECTOR }, { .sector = NO_SECTOR } };
+static readbuf_t *readtmp = &readbufs[0], *readahead = &readbufs[1];
+
+typedef struct {
+    uint8_t buf[528];
+    volatile int busy;
+} writebuf_t;
+
+static writebuf_t writetmp;
 int is_write, is_dma_read;
 uint32_t readptr, writeptr;
 static volatile int mc_exit_request, mc_exit_response, mc_enter_request, mc_enter_response;
 static uint8_t hostkey[9];
+static volatile ps2_mc_errors_t mc_errors;
+
+/* called once a read has landed - from the DMA irq on core0, so the 0x43 loop doesn't have to encode ecc */
+static void __time_critical_func(read_mc_done)(readbuf_t *rb) {
+    rb->landed = 1;
+    ps2_ecc_sector(rb->buf, &rb->buf[512]);
+    rb->ecc_ready = 1;
+    rb->queued = 0;
+}
+
+/* both buffers can have a read queued at once, so each gets its own callback */
+static void __time_critical_func(read_mc_done_0)(void) {
+    read_mc_done(&readbufs[0]);
+}
 
-static inline void __time_critical_func(read_mc)(uint32_t addr, void *buf, size_t sz) {
+static void __time_critical_func(read_mc_done_1)(void) {
+    read_mc_done(&readbufs[1]);
+}
+
+static void __time_critical_func(read_mc_start)(readbuf_t *rb, uint32_t sector) {
+    /* an older read into the same buffer (e.g. one that got invalidated) would land on top of this one */
+    while (rb->queued) {
+    }
+    rb->queued = 1;
+    rb->sector = sector;
+    rb->landed = rb->ecc_ready = 0;
     if (flash_mode) {
-        ps2_exploit_read(addr, buf, sz);
-        ps2_dirty_unlock();
+        ps2_exploit_read(sector * 512, rb, 512+4);
+        read_mc_done(rb);
     } else {
-        psram_read_dma(addr, buf, sz);
+        psram_read_dma(sector * 512, rb, 512+4, (rb == &readbufs[0]) ? read_mc_done_0 : read_mc_done_1);
     }
 }
 
-static inline void __time_critical_func(write_mc)(uint32_t addr, void *buf, size_t sz) {
-    if (!flash_mode) {
-        psram_write(addr, buf, sz);
+static inline void __time_critical_func(read_mc)(uint32_t sector) {
+    ps2_dirty_note_access();
+    if (readahead->sector == sector) {
+        readbuf_t *tmp = readtmp;
+        readtmp = readahead;
+        readahead = tmp;
     } else {
-        ps2_dirty_unlock();
+        read_mc_start(readtmp, sector);
+    }
+}
+
+/* start fetching the sector after readtmp, unless the psram is busy right now */
+static inline void __time_critical_func(read_mc_ahead)(void) {
+    uint32_t sector = readtmp->sector + 1;
+    if (readtmp->sector == NO_SECTOR || readahead->sector == sector)
+        return;
+    if (sector * 512 + 512 > ps2_cardman_get_card_size())
+        return;
+    if (!psram_idle())
+        return;
+    read_mc_start(readahead, sector);
+}
+
+static inline void __time_critical_func(read_mc_invalidate)(uint32_t sector, uint32_t count) {
+    if (readtmp->sector - sector < count)
+        readtmp->sector = NO_SECTOR;
+    if (readahead->sector - sector < count)
+        readahead->sector = NO_SECTOR;
+}
+
+static inline void __time_critical_func(read_mc_wait)(void) {
+    while (!readtmp->landed) {
+    }
+}
+
+static inline void __time_critical_func(read_mc_wait_ecc)(void) {
+    while (!readtmp->ecc_ready) {
+    }
+}
+
+/* queued ahead of anything that gets to the psram later, so no read can see the old data */
+static inline void __time_critical_func(erase_mc)(uint32_t sector, uint32_t count) {
+    if (!flash_mode)
+        psram_fill_dma(sector * 512, 0xFF, count * 512, NULL);
+}
+
+static void __time_critical_func(write_mc_done)(void) {
+    writetmp.busy = 0;
+}
+
+/* queued ahead of anything that gets to the psram later, writetmp stays busy until the sector is in */
+static inline void __time_critical_func(write_mc_commit)(uint32_t sector) {
+    if (!flash_mode) {
+        writetmp.busy = 1;
+        psram_write_dma(sector * 512, writetmp.buf, 512, write_mc_done);
+    }
+}
+
+static inline int __time_critical_func(write_mc_full)(void) {
+    return !flash_mode && psram_get_dropped_sectors() != 0;
+}
+
+/* writetmp can't take new data until the previous commit is out of it */
+static inline void __time_critical_func(write_mc_wait)(void) {
+    while (writetmp.busy) {
     }
 }
 
@@ -81,20 +202,21 @@ static inline void __time_critical_func(RAM_pio_sm_drain_tx_fifo)(PIO pio, uint
 }
 
 static void __time_critical_func(reset_pio)(void) {
-    pio_set_sm_mask_enabled(pio0, (1 << cmd_reader.sm) | (1 << dat_writer.sm) | (1 << dat_writer_slow.sm) | (1 << clock_probe.sm), false);
-    pio_restart_sm_mask(pio0, (1 << cmd_reader.sm) | (1 << dat_writer.sm) | (1 << dat_writer_slow.sm) | (1 << clock_probe.sm));
+    /* stop streaming before draining, or the dma would just refill the fifo */
+    dma_channel_abort(PIO_MC_DMA_TX_CHAN);
+
+    pio_set_sm_mask_enabled(pio0, (1 << cmd_reader.sm) | (1 << dat_writer.sm) | (1 << clock_probe.sm), false);
+    pio_restart_sm_mask(pio0, (1 << cmd_reader.sm) | (1 << dat_writer.sm) | (1 << clock_probe.sm));
 
     pio_sm_exec(pio0, cmd_reader.sm, pio_encode_jmp(cmd_reader.offset));
     pio_sm_exec(pio0, dat_writer.sm, pio_encode_jmp(dat_writer.offset));
-    pio_sm_exec(pio0, dat_writer_slow.sm, pio_encode_jmp(dat_writer_slow.offset));
     pio_sm_exec(pio0, clock_probe.sm, pio_encode_jmp(clock_probe.offset));
 
     pio_sm_clear_fifos(pio0, cmd_reader.sm);
     RAM_pio_sm_drain_tx_fifo(pio0, dat_writer.sm);
-    RAM_pio_sm_drain_tx_fifo(pio0, dat_writer_slow.sm);
     pio_sm_clear_fifos(pio0, clock_probe.sm);
 
-    pio_enable_sm_mask_in_sync(pio0, (1 << cmd_reader.sm) | (1 << dat_writer.sm) | (1 << dat_writer_slow.sm) | (1 << clock_probe.sm));
+    pio_enable_sm_mask_in_sync(pio0, (1 << cmd_reader.sm) | (1 << dat_writer.sm) | (1 << clock_probe.sm));
 
     reset = 1;
 }
@@ -118,18 +240,24 @@ static void __time_critical_func(init_pio)(void) {
     dat_writer.offset = pio_add_program(pio0, &dat_writer_program);
     dat_writer.sm = pio_claim_unused_sm(pio0, true);
 
-    dat_writer_slow.offset = pio_add_program(pio0, &dat_writer_slow_program);
-    dat_writer_slow.sm = pio_claim_unused_sm(pio0, true);
-
     clock_probe.offset = pio_add_program(pio0, &clock_probe_program);
     clock_probe.sm = pio_claim_unused_sm(pio0, true);
 
     cmd_reader_program_init(pio0, cmd_reader.sm, cmd_reader.offset);
     dat_writer_program_init(pio0, dat_writer.sm, dat_writer.offset);
-    dat_writer_slow_program_init(pio0, dat_writer_slow.sm, dat_writer_slow.offset);
+    /* y survives restarts, so it only changes when mc_latch_clock picks another profile */
+    pio_sm_exec(pio0, dat_writer.sm, pio_encode_set(pio_y, mc_clock->timed));
     clock_probe_program_init(pio0, clock_probe.sm, clock_probe.offset);
 }
 
+static void init_stream_dma(dma_channel_config *conf, uint sm) {
+    *conf = dma_channel_get_default_config(PIO_MC_DMA_TX_CHAN);
+    channel_config_set_transfer_data_size(conf, DMA_SIZE_8);
+    channel_config_set_read_increment(conf, true);
+    channel_config_set_write_increment(conf, false);
+    channel_config_set_dreq(conf, pio_get_dreq(pio0, sm, true));
+}
+
 static void __time_critical_func(card_deselected)(uint gpio, uint32_t event_mask) {
     if (gpio == PIN_PSX_SEL && (event_mask & GPIO_IRQ_EDGE_RISE)) {
         reset_pio();
@@ -145,7 +273,7 @@ static void __time_critical_func(card_deselected)(uint gpio, uint32_t event_mask
         pio_sm_is_rx_fifo_empty(pio0, cmd_reader.sm) && \
     1) { \
         if (reset) \
-            goto NEXTCMD; \
+            return; \
     } \
     cmd = (uint8_t) (pio_sm_get(pio0, cmd_reader.sm) >> 24); \
 } while (0);
@@ -166,36 +294,36 @@ static void __time_critical_func(card_deselected)(uint gpio, uint32_t event_mask
     cmd = (uint8_t) (pio_sm_get(pio0, cmd_reader.sm) >> 24); \
 } while (0);
 
-static inline uint32_t __time_critical_func(probe_clock)(void) {
-    return pio_sm_get_blocking(pio0, clock_probe.sm);
+/* clock_probe measured the first bit of this selection - move the writer over if the console changed its clock */
+static inline void __time_critical_func(mc_latch_clock)(void) {
+    if (pio_sm_is_rx_fifo_empty(pio0, clock_probe.sm))
+        return;
+
+    uint32_t low = pio_sm_get(pio0, clock_probe.sm);
+    mc_clock_profile_t *profile = mc_clock_profiles;
+    while (low >= profile->max_low)
+        ++profile;
+
+    if (profile != mc_clock) {
+        mc_clock = profile;
+        /* the writer is parked on its pull, y only matters once it gets the first byte */
+        pio_sm_exec(pio0, dat_writer.sm, pio_encode_set(pio_y, profile->timed));
+        debug_printf("clock up to %d kHz\n", (int)profile->khz);
+    }
 }
 
-static inline void __time_critical_func(mc_respond_fast)(uint8_t ch) {
+static inline void __time_critical_func(mc_respond)(uint8_t ch) {
     pio_sm_put_blocking(pio0, dat_writer.sm, ch);
 }
 
-static inline void __time_critical_func(mc_respond_slow)(uint8_t ch) {
-    pio_sm_put_blocking(pio0, dat_writer_slow.sm, ch);
-}
-
-static uint8_t EccTable[] = {
-	0x00, 0x87, 0x96, 0x11, 0xa5, 0x22, 0x33, 0xb4,0xb4, 0x33, 0x22, 0xa5, 0x11, 0x96, 0x87, 0x00,
-	0xc3, 0x44, 0x55, 0xd2, 0x66, 0xe1, 0xf0, 0x77,0x77, 0xf0, 0xe1, 0x66, 0xd2, 0x55, 0x44, 0xc3,
-	0xd2, 0x55, 0x44, 0xc3, 0x77, 0xf0, 0xe1, 0x66,0x66, 0xe1, 0xf0, 0x77, 0xc3, 0x44, 0x55, 0xd2,
-	0x11, 0x96, 0x87, 0x00, 0xb4, 0x33, 0x22, 0xa5,0xa5, 0x22, 0x33, 0xb4, 0x00, 0x87, 0x96, 0x11,
-	0xe1, 0x66, 0x77, 0xf0, 0x44, 0xc3, 0xd2, 0x55,0x55, 0xd2, 0xc3, 0x44, 0xf0, 0x77, 0x66, 0xe1,
-	0x22, 0xa5, 0xb4, 0x33, 0x87, 0x00, 0x11, 0x96,0x96, 0x11, 0x00, 0x87, 0x33, 0xb4, 0xa5, 0x22,
-	0x33, 0xb4, 0xa5, 0x22, 0x96, 0x11, 0x00, 0x87,0x87, 0x00, 0x11, 0x96, 0x22, 0xa5, 0xb4, 0x33,
-	0xf0, 0x77, 0x66, 0xe1, 0x55, 0xd2, 0xc3, 0x44,0x44, 0xc3, 0xd2, 0x55, 0xe1, 0x66, 0x77, 0xf0,
-	0xf0, 0x77, 0x66, 0xe1, 0x55, 0xd2, 0xc3, 0x44,0x44, 0xc3, 0xd2, 0x55, 0xe1, 0x66, 0x77, 0xf0,
-	0x33, 0xb4, 0xa5, 0x22, 0x96, 0x11, 0x00, 0x87,0x87, 0x00, 0x11, 0x96, 0x22, 0xa5, 0xb4, 0x33,
-	0x22, 0xa5, 0xb4, 0x33, 0x87, 0x00, 0x11, 0x96,0x96, 0x11, 0x00, 0x87, 0x33, 0xb4, 0xa5, 0x22,
-	0xe1, 0x66, 0x77, 0xf0, 0x44, 0xc3, 0xd2, 0x55,0x55, 0xd2, 0xc3, 0x44, 0xf0, 0x77, 0x66, 0xe1,
-	0x11, 0x96, 0x87, 0x00, 0xb4, 0x33, 0x22, 0xa5,0xa5, 0x22, 0x33, 0xb4, 0x00, 0x87, 0x96, 0x11,
-	0xd2, 0x55, 0x44, 0xc3, 0x77, 0xf0, 0xe1, 0x66,0x66, 0xe1, 0xf0, 0x77, 0xc3, 0x44, 0x55, 0xd2,
-	0xc3, 0x44, 0x55, 0xd2, 0x66, 0xe1, 0xf0, 0x77,0x77, 0xf0, 0xe1, 0x66, 0xd2, 0x55, 0x44, 0xc3,
-	0x00, 0x87, 0x96, 0x11, 0xa5, 0x22, 0x33, 0xb4,0xb4, 0x33, 0x22, 0xa5, 0x11, 0x96, 0x87, 0x00
-};
+static inline void __time_critical_func(mc_stream)(const uint8_t *buf, uint32_t len) {
+    dma_channel_configure(PIO_MC_DMA_TX_CHAN, &stream_conf, &pio0->txf[dat_writer.sm], buf, len, true);
+    /* deselected before the dma got armed - reset_pio already ran, so clean up after ourselves */
+    if (reset) {
+        dma_channel_abort(PIO_MC_DMA_TX_CHAN);
+        RAM_pio_sm_drain_tx_fifo(pio0, dat_writer.sm);
+    }
+}
 
 // keysource and key are self generated values
 uint8_t keysource[] = { 0xf5, 0x80, 0x95, 0x3c, 0x4c, 0x84, 0xa9, 0xc0 };
@@ -275,9 +403,22 @@ static void __time_critical_func(generateResponse)() {
 	doubleDesEncrypt(key, CardResponse3);
 }
 
+typedef void (*mc_handler_t)(void);
+
+/* sub command of the running transaction, for the handlers that want to log it */
+static uint8_t mc_ch;
+/* MagicGate step of the running 0xF0 */
+static uint8_t mc_auth_ch;
+
+#define send mc_respond
+#define send_stream mc_stream
+#include "ps2_memory_card.in.c"
+#undef send_stream
+#undef send
+
 static void __time_critical_func(mc_main_loop)(void) {
     while (1) {
-        uint8_t cmd, ch;
+        uint8_t cmd;
 
 NEXTCMD:
         while (!reset && !reset && !reset && !reset && !reset) {
@@ -289,15 +430,14 @@ NEXTCMD:
         recvfirst();
 
         if (cmd == 0x81) {
-            if (probe_clock()) {
-#define send mc_respond_fast
-#include "ps2_memory_card.in.c"
-#undef send
-            } else {
-#define send mc_respond_slow
-#include "ps2_memory_card.in.c"
-#undef send
-            }
+#ifdef DEBUG_MC_TIMING
+            uint32_t start = timer_hw->timerawl;
+#endif
+            mc_latch_clock();
+            mc_transaction();
+#ifdef DEBUG_MC_TIMING
+            ps2_mc_timing_record(mc_ch, mc_auth_ch, timer_hw->timerawl - start);
+#endif
         } else {
             // not for us
             continue;
@@ -314,6 +454,9 @@ static void __no_inline_not_in_flash_func(mc_main)(void) {
         {}
         mc_enter_response = 1;
 
+        /* whatever is buffered may come from the other backing store */
+        readtmp->sector = readahead->sector = NO_SECTOR;
+
         mc_main_loop();
     }
 }
@@ -366,6 +509,8 @@ static void my_gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bo
 
 void ps2_memory_card_main(void) {
     init_pio();
+    init_stream_dma(&stream_conf, dat_writer.sm);
+    mc_init_cmds();
     generateIvSeedNonce();
 
     us_startup = time_us_64();
@@ -405,6 +550,13 @@ void ps2_memory_card_enter(void) {
     flash_mode = false;
 }
 
+void ps2_memory_card_get_errors(ps2_mc_errors_t *errors) {
+    errors->erase_addr = mc_errors.erase_addr;
+    errors->write_addr = mc_errors.write_addr;
+    errors->read_addr = mc_errors.read_addr;
+    errors->write_data = mc_errors.write_data;
+}
+
 void ps2_memory_card_enter_flash(void) {
     mc_enter_request = 1;
     while (!mc_enter_response)
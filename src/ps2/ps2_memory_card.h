@@ -1,8 +1,18 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+/* commands answered with the error terminator because their checksum didn't match */
+typedef struct {
+    uint32_t erase_addr;  /* 0x21 */
+    uint32_t write_addr;  /* 0x22 */
+    uint32_t read_addr;   /* 0x23 */
+    uint32_t write_data;  /* 0x42 */
+} ps2_mc_errors_t;
 
 void ps2_memory_card_main(void);
 void ps2_memory_card_enter(void);
 void ps2_memory_card_enter_flash(void);
 void ps2_memory_card_exit(void);
+void ps2_memory_card_get_errors(ps2_mc_errors_t *errors);
@@ -1,90 +1,157 @@
+/*
+ * Command handlers for the 0x81 transaction, included at file scope by ps2_memory_card.c.
+ *
+ * Everything the handlers touch outside of their own state goes through a small set of hooks
+ * provided by the includer, so they can be built against stand-ins (e.g. on the host):
+ *   send(ch)            - queue a reply byte
+ *   send_stream(buf, n) - queue n reply bytes from buf without involving the cpu
+ *   recv()              - wait for the next command byte into `cmd`, return from the handler on reset
+ *   read_mc()           - make readtmp hold a sector, either from the read-ahead or by starting a fetch
+ *   read_mc_ahead()     - start fetching the sector after readtmp in the background
+ *   read_mc_invalidate()- drop buffered sectors that got overwritten
+ *   read_mc_wait()      - block until the data of readtmp has landed
+ *   read_mc_wait_ecc()  - block until the spare area of readtmp has been encoded
+ *   erase_mc()          - queue setting a range of sectors to 0xFF
+ *   write_mc_commit()   - queue storing writetmp in the background
+ *   write_mc_wait()     - block until writetmp is free to take new data
+ *   write_mc_full()     - nonzero once a write had to be thrown away for lack of room
+ *   ps2_dirty_*()       - access timing/marks of the dirty tracker
+ *   ps2_cardman_get_card_size()
+ */
+
 #include <ps2/ps2_cardman.h>
 #include <stdint.h>
 #define XOR8(a) (a[0] ^ a[1] ^ a[2] ^ a[3] ^ a[4] ^ a[5] ^ a[6] ^ a[7])
 #define ARG8(a) a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]
+#define XOR_WORD(w) ((uint8_t)(((w) ^ ((w) >> 8) ^ ((w) >> 16) ^ ((w) >> 24)) & 0xFF))
 
-/* resp to 0x81 */
-send(0xFF);
+/* 8 bytes most significant first, then their checksum */
+#define SEND8(a) do { \
+    for (int i = 7; i >= 0; --i) { \
+        send(a[i]); recv(); \
+    } \
+    send(XOR8(a)); recv(); \
+} while (0)
 
-/* sub cmd */
-recv();
-ch = cmd;
-#ifdef DEBUG_MC_PROTOCOL
-if (ch != 0x42 && ch != 0x43)
-    debug_printf("> %02X\n", ch);
-#endif
+/* 8 bytes most significant first */
+#define RECV8(a) do { \
+    for (int i = 7; i >= 0; --i) { \
+        send(0xFF); \
+        recv(); a[i] = cmd; \
+    } \
+} while (0)
+
+/* answer a bad checksum with the error terminator, the handler leaves its state alone */
+#define MC_CK_ERROR(counter) do { \
+    send(TERM_CK_ERROR); \
+    ++mc_errors.counter; \
+} while (0)
+
+/* 4 address bytes little endian, then their checksum - ck ends up 0 if it matched */
+#define RECV_ADDR(addr, ck) do { \
+    union { \
+        uint8_t a[4]; \
+        uint32_t addr; \
+    } raw; \
+    send(0xFF); recv(); raw.a[0] = cmd; \
+    send(0xFF); recv(); raw.a[1] = cmd; \
+    send(0xFF); recv(); raw.a[2] = cmd; \
+    send(0xFF); recv(); raw.a[3] = cmd; \
+    send(0xFF); recv(); ck = cmd; \
+    addr = raw.addr; \
+    ck ^= XOR_WORD(addr); \
+} while (0)
+
+static void __time_critical_func(mc_cmd_unknown)(void) {
+    debug_printf("!! unknown %02X\n", mc_ch);
+}
 
-if (ch == 0x11) {
+/* 0x11, 0x12 and the dummy auth steps */
+static void __time_critical_func(mc_cmd_ack)(void) {
+    __unused uint8_t cmd; /* recv wants somewhere to put the byte */
     send(0x2B); recv();
     send(term);
-} else if (ch == 0x12) {
+}
+
+/* 0xBF, 0xF3 */
+static void __time_critical_func(mc_cmd_ack_arg)(void) {
+    __unused uint8_t cmd;
+    send(0xFF); recv();
     send(0x2B); recv();
     send(term);
-} else if (ch == 0x21) {
+}
+
+static void __time_critical_func(mc_cmd_key_select)(void) {
+    // TODO: it fails to get detected at all when ps2_magicgate==0, check if it's intentional
+    if (!ps2_magicgate)
+    {
+        mc_cmd_unknown();
+        return;
+    }
+
+    /* SIO_MEMCARD_KEY_SELECT */
+    mc_cmd_ack_arg();
+}
+
+static void __time_critical_func(mc_cmd_erase_addr)(void) {
     /* set address for erase */
-    union {
-        uint8_t a[4];
-        uint32_t addr;
-    } raw;
-    uint8_t ck;
-    send(0xFF); recv(); raw.a[0] = cmd;
-    send(0xFF); recv(); raw.a[1] = cmd;
-    send(0xFF); recv(); raw.a[2] = cmd;
-    send(0xFF); recv(); raw.a[3] = cmd;
-    send(0xFF); recv(); ck = cmd;
+    uint8_t cmd, ck;
+    uint32_t addr;
+    RECV_ADDR(addr, ck);
     send(0x2B); recv();
-    (void)ck; // TODO: validate checksum
-    erase_sector = raw.addr;
+    if (ck) {
+        MC_CK_ERROR(erase_addr);
+        return;
+    }
+    erase_sector = addr;
     send(term);
-} else if (cmd == 0x22) {
+}
+
+static void __time_critical_func(mc_cmd_write_addr)(void) {
     /* set address for write */
-    union {
-        uint8_t a[4];
-        uint32_t addr;
-    } raw;
-    uint8_t ck;
-    send(0xFF); recv(); raw.a[0] = cmd;
-    send(0xFF); recv(); raw.a[1] = cmd;
-    send(0xFF); recv(); raw.a[2] = cmd;
-    send(0xFF); recv(); raw.a[3] = cmd;
-    send(0xFF); recv(); ck = cmd;
+    uint8_t cmd, ck;
+    uint32_t addr;
+    RECV_ADDR(addr, ck);
     send(0x2B); recv();
-    (void)ck; // TODO: validate checksum
-    write_sector = raw.addr;
+    if (ck) {
+        /* drop a previous write too, so a retried 0x42/0x81 can't land on the old address */
+        is_write = 0;
+        MC_CK_ERROR(write_addr);
+        return;
+    }
+    write_sector = addr;
     is_write = 1;
     writeptr = 0;
     send(term);
-} else if (ch == 0x23) {
+}
+
+static void __time_critical_func(mc_cmd_read_addr)(void) {
     /* set address for read */
-    union {
-        uint8_t a[4];
-        uint32_t addr;
-    } raw;
-    uint8_t ck;
-    send(0xFF); recv(); raw.a[0] = cmd;
-    send(0xFF); recv(); raw.a[1] = cmd;
-    send(0xFF); recv(); raw.a[2] = cmd;
-    send(0xFF); recv(); raw.a[3] = cmd;
-    send(0xFF); recv(); ck = cmd;
+    uint8_t cmd, ck;
+    uint32_t addr;
+    RECV_ADDR(addr, ck);
     send(0x2B); recv();
-    (void)ck; // TODO: validate checksum
-    read_sector = raw.addr;
+    if (ck) {
+        MC_CK_ERROR(read_addr);
+        return;
+    }
+    read_sector = addr;
     if (read_sector * 512 + 512 <= ps2_cardman_get_card_size()) {
-        ps2_dirty_lockout_renew();
-        /* the spinlock will be unlocked by the DMA irq once all data is tx'd */
-        ps2_dirty_lock();
-        read_mc(read_sector * 512, &readtmp, 512+4);
+        read_mc(read_sector);
         // dma_channel_wait_for_finish_blocking(0);
         // dma_channel_wait_for_finish_blocking(1);
+    } else {
+        /* nothing to fetch, serve whatever is left in the buffer */
+        ps2_ecc_sector(readtmp->buf, &readtmp->buf[512]);
     }
     readptr = 0;
 
-    eccptr = &readtmp.buf[512];
-    memset(eccptr, 0, 16);
-
     send(term);
-} else if (ch == 0x26) {
+}
+
+static void __time_critical_func(mc_cmd_get_specs)(void) {
     /* GET_SPECS ? */
+    __unused uint8_t cmd;
     send(0x2B); recv();
     uint32_t sector_count = (flash_mode) ? PS2_CARD_SIZE_1M / 512 : (uint32_t)(ps2_cardman_get_card_size() / 512);
 
@@ -104,388 +171,320 @@ if (ch == 0x11) {
     send(specs[7]); recv();
     send(XOR8(specs)); recv();
     send(term);
-} else if (ch == 0x27) {
+}
+
+static void __time_critical_func(mc_cmd_set_term)(void) {
     /* SET_TERMINATOR */
+    uint8_t cmd;
     send(0xFF);
     recv(); term = cmd;
     send(0x2B); recv();
     send(term);
-} else if (ch == 0x28) {
+}
+
+static void __time_critical_func(mc_cmd_get_term)(void) {
     /* GET_TERMINATOR */
+    __unused uint8_t cmd;
     send(0x2B); recv();
     send(term); recv();
     send(term);
-} else if (ch == 0x42) {
+}
+
+static void __time_critical_func(mc_cmd_write_data)(void) {
     /* write data */
-    uint8_t sz;
+    uint8_t cmd, sz;
     send(0xFF); recv(); sz = cmd;
     send(0xFF);
 
 #ifdef DEBUG_MC_PROTOCOL
-    debug_printf("> %02X %02X\n", ch, sz);
+    debug_printf("> %02X %02X\n", mc_ch, sz);
 #endif
 
     uint8_t ck = 0;
     uint8_t b;
 
+    /* the previous commit is normally long gone by the time the console gets here */
+    write_mc_wait();
+
     for (int i = 0; i < sz; ++i) {
         recv(); b = cmd;
-        if (writeptr < sizeof(writetmp)) {
-            writetmp[writeptr] = b;
+        if (writeptr < sizeof(writetmp.buf)) {
+            writetmp.buf[writeptr] = b;
             ++writeptr;
         }
         ck ^= b;
         send(0xFF);
     }
-    // this should be checksum?
+    /* checksum of the data */
     recv();
-    uint8_t ck2 = cmd;
-    (void)ck2; // TODO: validate checksum
+    ck ^= cmd;
 
     send(0x2B); recv();
+    if (ck) {
+        /* don't commit a sector with garbage in it, the console retries the whole write */
+        is_write = 0;
+        MC_CK_ERROR(write_data);
+        return;
+    }
     send(term);
-} else if (ch == 0x43) {
+}
+
+static void __time_critical_func(mc_cmd_read_data)(void) {
     /* read data */
-    uint8_t sz;
+    uint8_t cmd, sz;
     send(0xFF); recv(); sz = cmd;
     send(0x2B); recv();
 
 #ifdef DEBUG_MC_PROTOCOL
-    debug_printf("> %02X %02X\n", ch, sz);
+    debug_printf("> %02X %02X\n", mc_ch, sz);
 #endif
 
     uint8_t ck = 0;
-    uint8_t b = 0xFF;
+    uint32_t remain = sz;
 
-    for (int i = 0; i < sz; ++i) {
-        if (readptr == sizeof(readtmp.buf)) {
+    while (remain) {
+        if (readptr == sizeof(readtmp->buf)) {
             /* a game may read more than one 528-byte sector in a sequence of read ops, e.g. re4 */
             ++read_sector;
             if (read_sector * 512 + 512 <= ps2_cardman_get_card_size()) {
-                ps2_dirty_lockout_renew();
-                /* the spinlock will be unlocked by the DMA irq once all data is tx'd */
-                ps2_dirty_lock();
-                read_mc(read_sector * 512, &readtmp, 512+4);
-                // TODO: remove this if safe
-                // must make sure the dma completes for first byte before we start reading below
-                dma_channel_wait_for_finish_blocking(PIO_SPI_DMA_RX_CHAN);
-                dma_channel_wait_for_finish_blocking(PIO_SPI_DMA_TX_CHAN);
+                /* normally already prefetched by read_mc_ahead at the end of the previous sector */
+                read_mc(read_sector);
+            } else {
+                ps2_ecc_sector(readtmp->buf, &readtmp->buf[512]);
             }
             readptr = 0;
-
-            eccptr = &readtmp.buf[512];
-            memset(eccptr, 0, 16);
         }
 
-        if (readptr < sizeof(readtmp.buf)) {
-            b = readtmp.buf[readptr];
-            send(b);
-
-            if (readptr <= 512) {
-                uint8_t c = EccTable[b];
-                eccptr[0] ^= c;
-                if (c & 0x80) {
-                    eccptr[1] ^= ~(readptr & 0x7F);
-                    eccptr[2] ^= (readptr & 0x7F);
-                }
-
-                ++readptr;
-
-                if ((readptr & 0x7F) == 0) {
-                    eccptr[0] = ~eccptr[0];
-                    eccptr[0] &= 0x77;
-
-                    eccptr[1] = ~eccptr[1];
-                    eccptr[1] &= 0x7f;
+        uint32_t len = sizeof(readtmp->buf) - readptr;
+        if (len > remain)
+            len = remain;
+        remain -= len;
 
-                    eccptr[2] = ~eccptr[2];
-                    eccptr[2] &= 0x7f;
+        /* the psram read can still be queued behind another burst, the stream mustn't start on the old data */
+        if (readptr < 512)
+            read_mc_wait();
+        /* spare area is encoded by read_mc_done, by now it's long finished */
+        if (readptr + len > 512)
+            read_mc_wait_ecc();
 
-                    eccptr += 3;
-                }
-            } else {
-                ++readptr;
-            }
-        } else send(b);
-        ck ^= b;
-        recv();
+        /* the dma feeds the writer, all that's left for us is to keep up with the console and fold the checksum */
+        send_stream(&readtmp->buf[readptr], len);
+        while (len--) {
+            ck ^= readtmp->buf[readptr++];
+            recv();
+        }
     }
 
     send(ck); recv();
     send(term);
-} else if (ch == 0x81) {
+
+    /* done with the data part, get the next sector going while the console is busy elsewhere */
+    if (readptr >= 512)
+        read_mc_ahead();
+}
+
+static void __time_critical_func(mc_cmd_commit)(void) {
     /* commit for read/write? */
+    __unused uint8_t cmd;
     if (is_write) {
         is_write = 0;
+        /* the card lost a write already, don't make the console believe any more of them stuck */
+        if (write_mc_full()) {
+            send(0x2B); recv();
+            send(TERM_CK_ERROR);
+            return;
+        }
         if (write_sector * 512 + 512 <= ps2_cardman_get_card_size()) {
-            ps2_dirty_lockout_renew();
-            ps2_dirty_lock();
-            write_mc(write_sector * 512, writetmp, 512);
+            ps2_dirty_note_access();
+            /* queue the write before marking, so a flush that picks the sector up reads it after the write */
+            write_mc_commit(write_sector);
             ps2_dirty_mark(write_sector);
-            ps2_dirty_unlock();
+            read_mc_invalidate(write_sector, 1);
 #ifdef DEBUG_MC_PROTOCOL
             debug_printf("WR 0x%08X : %02X %02X .. %08X %08X %08X\n",
-                write_sector * 512, writetmp[0], writetmp[1],
-                *(uint32_t*)&writetmp[512], *(uint32_t*)&writetmp[516], *(uint32_t*)&writetmp[520]);
+                write_sector * 512, writetmp.buf[0], writetmp.buf[1],
+                *(uint32_t*)&writetmp.buf[512], *(uint32_t*)&writetmp.buf[516], *(uint32_t*)&writetmp.buf[520]);
 #endif
         }
     } else {
 #ifdef DEBUG_MC_PROTOCOL
         debug_printf("RD 0x%08X : %02X %02X .. %08X %08X %08X\n",
-            read_sector * 512, readtmp.buf[0], readtmp.buf[1],
-            *(uint32_t*)&readtmp.buf[512], *(uint32_t*)&readtmp.buf[516], *(uint32_t*)&readtmp.buf[520]);
+            read_sector * 512, readtmp->buf[0], readtmp->buf[1],
+            *(uint32_t*)&readtmp->buf[512], *(uint32_t*)&readtmp->buf[516], *(uint32_t*)&readtmp->buf[520]);
 #endif
     }
 
     send(0x2B); recv();
     send(term);
-} else if (ch == 0x82) {
+}
+
+static void __time_critical_func(mc_cmd_erase)(void) {
     /* do erase */
+    __unused uint8_t cmd;
     if (erase_sector * 512 + 512 * ERASE_SECTORS <= ps2_cardman_get_card_size()) {
-        memset(readtmp.buf, 0xFF, 512);
-        ps2_dirty_lockout_renew();
-        ps2_dirty_lock();
-        for (int i = 0; i < ERASE_SECTORS; ++i) {
-            write_mc((erase_sector + i) * 512, readtmp.buf, 512);
-            ps2_dirty_mark(erase_sector + i);
-        }
-        ps2_dirty_unlock();
+        ps2_dirty_note_access();
+        /* acked right away, the fill is queued ahead of whatever wants these sectors next */
+        erase_mc(erase_sector, ERASE_SECTORS);
+        ps2_dirty_mark_range(erase_sector, ERASE_SECTORS);
+        read_mc_invalidate(erase_sector, ERASE_SECTORS);
 #ifdef DEBUG_MC_PROTOCOL
         debug_printf("ER 0x%08X\n", erase_sector * 512);
 #endif
     }
     send(0x2B); recv();
     send(term);
-} else if (ch == 0xBF) {
+}
+
+static void __time_critical_func(mc_auth_iv)(void) {
+    __unused uint8_t cmd;
+    debug_printf("iv : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(iv));
+
+    /* get IV */
+    send(0x2B); recv();
+    SEND8(iv);
+    send(term);
+}
+
+static void __time_critical_func(mc_auth_seed)(void) {
+    __unused uint8_t cmd;
+    debug_printf("seed : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(seed));
+
+    /* get seed */
+    send(0x2B); recv();
+    SEND8(seed);
+    send(term);
+}
+
+static void __time_critical_func(mc_auth_nonce)(void) {
+    __unused uint8_t cmd;
+    debug_printf("nonce : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(nonce));
+
+    /* get nonce */
+    send(0x2B); recv();
+    SEND8(nonce);
+    send(term);
+}
+
+static void __time_critical_func(mc_auth_challenge3)(void) {
+    /* MechaChallenge3 */
+    uint8_t cmd;
+    RECV8(MechaChallenge3);
+    /* TODO: checksum below */
     send(0xFF); recv();
     send(0x2B); recv();
     send(term);
-} else if (ch == 0xF3) {
+
+    debug_printf("MechaChallenge3 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(MechaChallenge3));
+}
+
+static void __time_critical_func(mc_auth_challenge2)(void) {
+    /* MechaChallenge2 */
+    uint8_t cmd;
+    RECV8(MechaChallenge2);
+    /* TODO: checksum below */
     send(0xFF); recv();
     send(0x2B); recv();
     send(term);
-} else if ((ch == 0xF7) && ps2_magicgate) { // TODO: it fails to get detected at all when ps2_magicgate==0, check if it's intentional
-    /* SIO_MEMCARD_KEY_SELECT */
+
+    debug_printf("MechaChallenge2 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(MechaChallenge2));
+}
+
+static void __time_critical_func(mc_auth_challenge1)(void) {
+    /* MechaChallenge1 */
+    uint8_t cmd;
+    RECV8(MechaChallenge1);
+    /* TODO: checksum below */
     send(0xFF); recv();
     send(0x2B); recv();
     send(term);
-} else if ((ch == 0xF0) && ps2_magicgate) {
-    /* auth stuff */
-    send(0xFF);
-    recv();
-    int subcmd = cmd;
-    if (subcmd == 0) {
-        /* probe support ? */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 1) {
-        debug_printf("iv : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(iv));
 
-        /* get IV */
-        send(0x2B); recv();
-        send(iv[7]); recv();
-        send(iv[6]); recv();
-        send(iv[5]); recv();
-        send(iv[4]); recv();
-        send(iv[3]); recv();
-        send(iv[2]); recv();
-        send(iv[1]); recv();
-        send(iv[0]); recv();
-        send(XOR8(iv)); recv();
-        send(term);
-    } else if (subcmd == 2) {
-        debug_printf("seed : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(seed));
+    debug_printf("MechaChallenge1 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(MechaChallenge1));
+}
 
-        /* get seed */
-        send(0x2B); recv();
-        send(seed[7]); recv();
-        send(seed[6]); recv();
-        send(seed[5]); recv();
-        send(seed[4]); recv();
-        send(seed[3]); recv();
-        send(seed[2]); recv();
-        send(seed[1]); recv();
-        send(seed[0]); recv();
-        send(XOR8(seed)); recv();
-        send(term);
-    } else if (subcmd == 3) {
-        /* dummy 3 */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 4) {
-        debug_printf("nonce : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(nonce));
+static void __time_critical_func(mc_auth_gen_response)(void) {
+    /* dummy E */
+    generateResponse();
+    debug_printf("CardResponse1 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(CardResponse1));
+    debug_printf("CardResponse2 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(CardResponse2));
+    debug_printf("CardResponse3 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(CardResponse3));
+    mc_cmd_ack();
+}
 
-        /* get nonce */
-        send(0x2B); recv();
-        send(nonce[7]); recv();
-        send(nonce[6]); recv();
-        send(nonce[5]); recv();
-        send(nonce[4]); recv();
-        send(nonce[3]); recv();
-        send(nonce[2]); recv();
-        send(nonce[1]); recv();
-        send(nonce[0]); recv();
-        send(XOR8(nonce)); recv();
-        send(term);
-    } else if (subcmd == 5) {
-        /* dummy 5 */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 6) {
-        /* MechaChallenge3 */
-        send(0xFF);
-        recv(); MechaChallenge3[7] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge3[6] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge3[5] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge3[4] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge3[3] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge3[2] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge3[1] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge3[0] = cmd;
-        /* TODO: checksum below */
-        send(0xFF); recv();
-        send(0x2B); recv();
-        send(term);
+static void __time_critical_func(mc_auth_response1)(void) {
+    /* CardResponse1 */
+    __unused uint8_t cmd;
+    send(0x2B); recv();
+    SEND8(CardResponse1);
+    send(term);
+}
 
-        debug_printf("MechaChallenge3 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(MechaChallenge3));
-    } else if (subcmd == 7) {
-        /* MechaChallenge2 */
-        send(0xFF);
-        recv(); MechaChallenge2[7] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge2[6] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge2[5] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge2[4] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge2[3] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge2[2] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge2[1] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge2[0] = cmd;
-        /* TODO: checksum below */
-        send(0xFF); recv();
-        send(0x2B); recv();
-        send(term);
+static void __time_critical_func(mc_auth_response2)(void) {
+    /* CardResponse2 */
+    __unused uint8_t cmd;
+    send(0x2B); recv();
+    SEND8(CardResponse2);
+    send(term);
+}
 
-        debug_printf("MechaChallenge2 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(MechaChallenge2));
-    } else if (subcmd == 8) {
-        /* dummy 8 */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 9) {
-        /* dummy 9 */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 0xA) {
-        /* dummy A */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 0xB) {
-        /* MechaChallenge1 */
-        send(0xFF);
-        recv(); MechaChallenge1[7] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge1[6] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge1[5] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge1[4] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge1[3] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge1[2] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge1[1] = cmd;
-        send(0xFF);
-        recv(); MechaChallenge1[0] = cmd;
-        /* TODO: checksum below */
-        send(0xFF); recv();
-        send(0x2B); recv();
-        send(term);
+static void __time_critical_func(mc_auth_response3)(void) {
+    /* CardResponse3 */
+    __unused uint8_t cmd;
+    send(0x2B); recv();
+    SEND8(CardResponse3);
+    send(term);
+}
 
-        debug_printf("MechaChallenge1 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(MechaChallenge1));
-    } else if (subcmd == 0xC) {
-        /* dummy C */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 0xD) {
-        /* dummy D */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 0xE) {
-        /* dummy E */
-        generateResponse();
-        debug_printf("CardResponse1 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(CardResponse1));
-        debug_printf("CardResponse2 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(CardResponse2));
-        debug_printf("CardResponse3 : %02X %02X %02X %02X %02X %02X %02X %02X\n", ARG8(CardResponse3));
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 0xF) {
-        /* CardResponse1 */
-        send(0x2B); recv();
-        send(CardResponse1[7]); recv();
-        send(CardResponse1[6]); recv();
-        send(CardResponse1[5]); recv();
-        send(CardResponse1[4]); recv();
-        send(CardResponse1[3]); recv();
-        send(CardResponse1[2]); recv();
-        send(CardResponse1[1]); recv();
-        send(CardResponse1[0]); recv();
-        send(XOR8(CardResponse1)); recv();
-        send(term);
-    } else if (subcmd == 0x10) {
-        /* dummy 10 */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 0x11) {
-        /* CardResponse2 */
-        send(0x2B); recv();
-        send(CardResponse2[7]); recv();
-        send(CardResponse2[6]); recv();
-        send(CardResponse2[5]); recv();
-        send(CardResponse2[4]); recv();
-        send(CardResponse2[3]); recv();
-        send(CardResponse2[2]); recv();
-        send(CardResponse2[1]); recv();
-        send(CardResponse2[0]); recv();
-        send(XOR8(CardResponse2)); recv();
-        send(term);
-    } else if (subcmd == 0x12) {
-        /* dummy 12 */
-        send(0x2B); recv();
-        send(term);
-    } else if (subcmd == 0x13) {
-        /* CardResponse3 */
-        send(0x2B); recv();
-        send(CardResponse3[7]); recv();
-        send(CardResponse3[6]); recv();
-        send(CardResponse3[5]); recv();
-        send(CardResponse3[4]); recv();
-        send(CardResponse3[3]); recv();
-        send(CardResponse3[2]); recv();
-        send(CardResponse3[1]); recv();
-        send(CardResponse3[0]); recv();
-        send(XOR8(CardResponse3)); recv();
-        send(term);
-    } else if (subcmd == 0x14) {
-        /* dummy 14 */
-        send(0x2B); recv();
-        send(term);
-    } else {
-        debug_printf("unknown %02X -> %02X\n", ch, subcmd);
+/* not const so the table stays in ram next to the handlers instead of going through xip */
+static mc_handler_t mc_auth_cmds[] = {
+    [0x00] = mc_cmd_ack, /* probe support ? */
+    [0x01] = mc_auth_iv,
+    [0x02] = mc_auth_seed,
+    [0x03] = mc_cmd_ack,
+    [0x04] = mc_auth_nonce,
+    [0x05] = mc_cmd_ack,
+    [0x06] = mc_auth_challenge3,
+    [0x07] = mc_auth_challenge2,
+    [0x08] = mc_cmd_ack,
+    [0x09] = mc_cmd_ack,
+    [0x0A] = mc_cmd_ack,
+    [0x0B] = mc_auth_challenge1,
+    [0x0C] = mc_cmd_ack,
+    [0x0D] = mc_cmd_ack,
+    [0x0E] = mc_auth_gen_response,
+    [0x0F] = mc_auth_response1,
+    [0x10] = mc_cmd_ack,
+    [0x11] = mc_auth_response2,
+    [0x12] = mc_cmd_ack,
+    [0x13] = mc_auth_response3,
+    [0x14] = mc_cmd_ack,
+};
+
+static void __time_critical_func(mc_cmd_auth)(void) {
+    uint8_t cmd;
+    if (!ps2_magicgate)
+    {
+        mc_cmd_unknown();
+        return;
+    }
+
+    /* auth stuff */
+    send(0xFF);
+    recv();
+    mc_auth_ch = cmd;
+    if (cmd < count_of(mc_auth_cmds))
+        mc_auth_cmds[cmd]();
+    else
+        debug_printf("unknown %02X -> %02X\n", mc_ch, cmd);
+}
+
+static void __time_critical_func(mc_cmd_session_key)(void) {
+    uint8_t cmd;
+    if (!ps2_magicgate)
+    {
+        mc_cmd_unknown();
+        return;
     }
-} else if ((ch == 0xF1 || ch == 0xF2) && ps2_magicgate) {
+
     /* session key encrypt */
     send(0xFF);
     recv();
@@ -515,10 +514,61 @@ if (ch == 0x11) {
         }
         send(term);
     } else {
-        debug_printf("!! unknown subcmd %02X -> %02X\n", 0xF2, subcmd);
+        debug_printf("!! unknown subcmd %02X -> %02X\n", mc_ch, subcmd);
     }
-} else {
-    debug_printf("!! unknown %02X\n", ch);
 }
 
+/* indexed by the sub command, unlisted ones are pointed at mc_cmd_unknown by mc_init_cmds */
+static mc_handler_t mc_cmds[256] = {
+    [0x11] = mc_cmd_ack,
+    [0x12] = mc_cmd_ack,
+    [0x21] = mc_cmd_erase_addr,
+    [0x22] = mc_cmd_write_addr,
+    [0x23] = mc_cmd_read_addr,
+    [0x26] = mc_cmd_get_specs,
+    [0x27] = mc_cmd_set_term,
+    [0x28] = mc_cmd_get_term,
+    [0x42] = mc_cmd_write_data,
+    [0x43] = mc_cmd_read_data,
+    [0x81] = mc_cmd_commit,
+    [0x82] = mc_cmd_erase,
+    [0xBF] = mc_cmd_ack_arg,
+    [0xF0] = mc_cmd_auth,
+    [0xF1] = mc_cmd_session_key,
+    [0xF2] = mc_cmd_session_key,
+    [0xF3] = mc_cmd_ack_arg,
+    [0xF7] = mc_cmd_key_select,
+};
+
+static void mc_init_cmds(void) {
+    for (size_t i = 0; i < count_of(mc_cmds); ++i)
+        if (!mc_cmds[i])
+            mc_cmds[i] = mc_cmd_unknown;
+}
+
+/* called once the console has addressed us with 0x81 */
+static void __time_critical_func(mc_transaction)(void) {
+    uint8_t cmd;
+
+    /* resp to 0x81 */
+    send(0xFF);
+
+    /* sub cmd */
+    recv();
+    mc_ch = cmd;
+    mc_auth_ch = 0;
+#ifdef DEBUG_MC_PROTOCOL
+    if (mc_ch != 0x42 && mc_ch != 0x43)
+        debug_printf("> %02X\n", mc_ch);
+#endif
+
+    mc_cmds[cmd]();
+}
+
+#undef RECV_ADDR
+#undef MC_CK_ERROR
+#undef RECV8
+#undef SEND8
+#undef XOR_WORD
+#undef ARG8
 #undef XOR8
@@ -6,11 +6,8 @@
 
 #include "ps2_pio_qspi.h"
 #include "config.h"
-#include "ps2_dirty.h"
 #include "hardware/dma.h"
 
-#define QSPI_DAT_MASK ((1 << (PSRAM_DAT+0)) | (1 << (PSRAM_DAT+1)) | (1 << (PSRAM_DAT+2)) | (1 << (PSRAM_DAT+3)))
-
 void __time_critical_func(pio_spi_write8_read8_blocking)(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *dst,
                                                          size_t dstlen) {
     io_rw_8 *txfifo = (io_rw_8 *) &spi->pio->txf[spi->sm];
@@ -33,78 +30,96 @@ void __time_critical_func(pio_spi_write8_read8_blocking)(const pio_spi_inst_t *s
     }
 }
 
-void __time_critical_func(pio_qspi_write8_read8_blocking)(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *dst,
-                                                          size_t dstlen) {
-    io_rw_8 *txfifo = (io_rw_8 *) &spi->pio->txf[spi->sm];
-    io_rw_8 *rxfifo = (io_rw_8 *) &spi->pio->rxf[spi->sm];
+/* leftovers of the previous transaction (its end marker) would throw off the rx count of the next one */
+static inline void __time_critical_func(qspi_drain_rx)(const pio_spi_inst_t *spi) {
+    while (!pio_sm_is_rx_fifo_empty(spi->pio, spi->sm))
+        (void) pio_sm_get(spi->pio, spi->sm);
+}
 
-    // TODO: this should be done nicer. while it's safe (since we drive the clock), it can be done much faster
-    pio_sm_set_pindirs_with_mask(spi->pio, spi->sm, QSPI_DAT_MASK, QSPI_DAT_MASK);
-    while (srclen) {
-        if (!pio_sm_is_tx_fifo_full(spi->pio, spi->sm)) {
-            *txfifo = *src++;
-            (void) *rxfifo;
-            --srclen;
-        }
-    }
-    // TODO: this should be done nicer. while it's safe (since we drive the clock), it can be done much faster
-    pio_sm_set_pindirs_with_mask(spi->pio, spi->sm, 0, QSPI_DAT_MASK);
+static inline uint32_t __time_critical_func(qspi_header)(size_t srclen, uint wait, size_t dstlen) {
+    return ((srclen * 2 - 1) << 16) | (wait << 12) | (dstlen * 2);
+}
 
-    while (dstlen) {
-        if (!pio_sm_is_rx_fifo_empty(spi->pio, spi->sm)) {
-            *txfifo = 0;
-            *dst++ = *rxfifo;
-            --dstlen;
-        }
-    }
+static inline uint32_t __time_critical_func(qspi_word)(const uint8_t *src) {
+    return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | src[3];
 }
 
-static dma_channel_config dma_rx_conf, dma_tx_conf;
+static dma_channel_config dma_rx_conf, dma_rx_drain_conf, dma_tx_write_conf, dma_tx_fill_conf;
+static volatile pio_qspi_dma_cb_t dma_done_cb;
 
-void __time_critical_func(pio_qspi_write8_read8_dma)(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *dst,
-                                                     size_t dstlen) {
-    io_rw_8 *txfifo = (io_rw_8 *) &spi->pio->txf[spi->sm];
-    io_rw_8 *rxfifo = (io_rw_8 *) &spi->pio->rxf[spi->sm];
+void __time_critical_func(pio_qspi_write8_read8_dma)(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint wait,
+                                                     uint8_t *dst, size_t dstlen, pio_qspi_dma_cb_t done_cb) {
+    qspi_drain_rx(spi);
 
-    // TODO: this should be done nicer. while it's safe (since we drive the clock), it can be done much faster
-    pio_sm_set_pindirs_with_mask(spi->pio, spi->sm, QSPI_DAT_MASK, QSPI_DAT_MASK);
-    while (srclen) {
-        if (!pio_sm_is_tx_fifo_full(spi->pio, spi->sm)) {
-            *txfifo = *src++;
-            (void) *rxfifo;
-            --srclen;
-        }
-    }
-    // TODO: this should be done nicer. while it's safe (since we drive the clock), it can be done much faster
-    pio_sm_set_pindirs_with_mask(spi->pio, spi->sm, 0, QSPI_DAT_MASK);
+    /* the fifo is empty and a command is a word or two, so this never waits */
+    dma_done_cb = done_cb;
+    dma_channel_configure(PIO_SPI_DMA_RX_CHAN, &dma_rx_conf, dst, &spi->pio->rxf[spi->sm], dstlen / 4, true);
+    pio_sm_put(spi->pio, spi->sm, qspi_header(srclen, wait, dstlen));
+    for (size_t i = 0; i < srclen; i += 4)
+        pio_sm_put(spi->pio, spi->sm, qspi_word(&src[i]));
+}
+
+/* the command goes in by the cpu, the data follows it by dma from wherever it lives so nothing is copied */
+static void __time_critical_func(qspi_write_dma_start)(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen,
+                                                       const dma_channel_config *conf, const void *data, size_t datalen,
+                                                       pio_qspi_dma_cb_t done_cb) {
+    qspi_drain_rx(spi);
+
+    static uint32_t dummy;
+    dma_done_cb = done_cb;
+    dma_channel_configure(PIO_SPI_DMA_RX_CHAN, &dma_rx_drain_conf, &dummy, &spi->pio->rxf[spi->sm], 1, true);
+    pio_sm_put(spi->pio, spi->sm, qspi_header(srclen + datalen, 0, 0));
+    for (size_t i = 0; i < srclen; i += 4)
+        pio_sm_put(spi->pio, spi->sm, qspi_word(&src[i]));
+    dma_channel_configure(PIO_SPI_DMA_TX_CHAN, conf, &spi->pio->txf[spi->sm], data, datalen / 4, true);
+}
 
-    static uint8_t zero = 0;
-    dma_channel_configure(PIO_SPI_DMA_RX_CHAN, &dma_rx_conf, dst, &spi->pio->rxf[spi->sm], dstlen, true);
-    /* just poke zeroes into the PIO tx so that it runs the bus */
-    dma_channel_configure(PIO_SPI_DMA_TX_CHAN, &dma_tx_conf, &spi->pio->txf[spi->sm], &zero, dstlen, true);
+void __time_critical_func(pio_qspi_write8_write_dma)(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *data,
+                                                      size_t datalen, pio_qspi_dma_cb_t done_cb) {
+    qspi_write_dma_start(spi, src, srclen, &dma_tx_write_conf, data, datalen, done_cb);
+}
+
+void __time_critical_func(pio_qspi_write8_fill_dma)(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t fill,
+                                                     size_t filllen, pio_qspi_dma_cb_t done_cb) {
+    /* the same word over and over */
+    static uint32_t fill_word;
+    fill_word = fill * 0x01010101u;
+    qspi_write_dma_start(spi, src, srclen, &dma_tx_fill_conf, &fill_word, filllen, done_cb);
 }
 
 static void __time_critical_func(dma_rx_done)(void) {
     /* note that this irq is called by core0 despite most dma tx started by core1 */
     dma_channel_acknowledge_irq0(PIO_SPI_DMA_RX_CHAN);
     gpio_put(PSRAM_CS, 1);
-    ps2_dirty_unlock();
+    pio_qspi_dma_cb_t cb = dma_done_cb;
+    dma_done_cb = NULL;
+    if (cb)
+        cb();
 }
 
 void pio_qspi_dma_init(const pio_spi_inst_t *spi) {
+    /* the program packs msb first, memory is little endian */
     dma_rx_conf = dma_channel_get_default_config(PIO_SPI_DMA_RX_CHAN);
-    channel_config_set_transfer_data_size(&dma_rx_conf, DMA_SIZE_8);
+    channel_config_set_transfer_data_size(&dma_rx_conf, DMA_SIZE_32);
     channel_config_set_read_increment(&dma_rx_conf, false);
     channel_config_set_write_increment(&dma_rx_conf, true);
+    channel_config_set_bswap(&dma_rx_conf, true);
     channel_config_set_dreq(&dma_rx_conf, pio_get_dreq(spi->pio, spi->sm, false));
 
     dma_channel_set_irq0_enabled(PIO_SPI_DMA_RX_CHAN, true);
     irq_set_exclusive_handler(DMA_IRQ_0, dma_rx_done);
     irq_set_enabled(DMA_IRQ_0, true);
 
-    dma_tx_conf = dma_channel_get_default_config(PIO_SPI_DMA_TX_CHAN);
-    channel_config_set_transfer_data_size(&dma_tx_conf, DMA_SIZE_8);
-    channel_config_set_read_increment(&dma_tx_conf, false);
-    channel_config_set_write_increment(&dma_tx_conf, false);
-    channel_config_set_dreq(&dma_tx_conf, pio_get_dreq(spi->pio, spi->sm, true));
+    dma_rx_drain_conf = dma_rx_conf;
+    channel_config_set_write_increment(&dma_rx_drain_conf, false);
+
+    dma_tx_write_conf = dma_channel_get_default_config(PIO_SPI_DMA_TX_CHAN);
+    channel_config_set_transfer_data_size(&dma_tx_write_conf, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_tx_write_conf, true);
+    channel_config_set_write_increment(&dma_tx_write_conf, false);
+    channel_config_set_bswap(&dma_tx_write_conf, true);
+    channel_config_set_dreq(&dma_tx_write_conf, pio_get_dreq(spi->pio, spi->sm, true));
+
+    dma_tx_fill_conf = dma_tx_write_conf;
+    channel_config_set_read_increment(&dma_tx_fill_conf, false);
 }
@@ -11,6 +11,8 @@
 
 #define PIO_SPI_DMA_RX_CHAN 0
 #define PIO_SPI_DMA_TX_CHAN 1
+/* feeds dat_writer on pio0 when streaming 0x43 read data */
+#define PIO_MC_DMA_TX_CHAN 2
 
 typedef struct pio_spi_inst {
     PIO pio;
@@ -24,9 +26,15 @@ void pio_spi_read8_blocking(const pio_spi_inst_t *spi, uint8_t *dst, size_t len)
 
 void pio_spi_write8_read8_blocking(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen);
 
-void pio_qspi_write8_read8_blocking(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen);
+typedef void (*pio_qspi_dma_cb_t)(void);
 
-void pio_qspi_write8_read8_dma(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen);
+/* qspi transactions move whole words - srclen and dstlen have to be multiples of 4, wait is in clock cycles */
+void pio_qspi_write8_read8_dma(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint wait, uint8_t *dst, size_t dstlen, pio_qspi_dma_cb_t done_cb);
+
+/* the data doesn't have to follow the command in memory, it has to be word aligned */
+void pio_qspi_write8_write_dma(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t *data, size_t datalen, pio_qspi_dma_cb_t done_cb);
+
+void pio_qspi_write8_fill_dma(const pio_spi_inst_t *spi, uint8_t *src, size_t srclen, uint8_t fill, size_t filllen, pio_qspi_dma_cb_t done_cb);
 
 void pio_qspi_dma_init(const pio_spi_inst_t *spi);
 
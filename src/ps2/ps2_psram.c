@@ -2,12 +2,16 @@
 #include "ps2_psram.h"
 
 #include "ps2_pio_qspi.h"
+#include "hardware/sync.h"
+#include "hardware/clocks.h"
 #include "hardware/timer.h"
 
 #include <stdio.h>
 #include <string.h>
 
 #include "debug.h"
+#include "settings.h"
+#include "bigmem.h"
 
 static pio_spi_inst_t spi = {
     .pio = pio1,
@@ -22,110 +26,626 @@ static pio_spi_inst_t spi = {
         gpio_put(spi.cs_pin, 1); \
     } while (0);
 
-#define TEST_CYCLES 30
-#define TEST_BLOCK_SIZE 1024
+/* 0xEB has 6 wait cycles between the address and the data */
+#define PSRAM_READ_WAIT 6
+
+/* a write burst wraps around at the end of the page instead of carrying on into the next one */
+#define PSRAM_PAGE_SIZE 1024
+
+/* longest CS low time (tCEM) the chip allows so it gets to refresh */
+#define PSRAM_TCEM_NS 8000
+
+/* bytes that fit into one burst without going over tCEM at the current clock */
+static uint32_t burst_max;
+
+#define PSRAM_SIZE (8 * 1024 * 1024)
+#define PSRAM_SECTOR_SIZE 512
+#define PSRAM_SLOTS (PSRAM_SIZE / PSRAM_SECTOR_SIZE)
+
+/*
+ * Card sectors don't sit at a fixed place in the chip. Each one that holds anything but 0xFF gets
+ * a 512 byte slot on first write, and psram_map (in bigmem, so it's in SRAM) says which. Sectors
+ * without a slot read back as 0xFF without touching the chip, and writing or erasing a sector to
+ * all 0xFF hands its slot back. Formatted cards are mostly 0xFF, so this lets images bigger
+ * than the chip be loaded as long as what's actually in them fits - and boot doesn't have to
+ * clear the chip.
+ *
+ * Only touched by the scheduler below, with sched_lock held.
+ */
+#define psram_map bigmem.ps2.psram_map
+#define MAP_SECTORS (sizeof(psram_map) / sizeof(*psram_map))
+
+static uint32_t slot_used[PSRAM_SLOTS / 32];
+static uint32_t slot_cursor;
+static uint32_t slots_free = PSRAM_SLOTS;
+/* sectors that couldn't be stored because the chip was full */
+static volatile uint32_t sectors_dropped;
+/* map entry of a sector whose write got dropped - it reads as 0xFF but must not be flushed */
+#define MAP_LOST UINT16_MAX
+/* where in the map the open card starts, so more than one card can stay loaded */
+static uint32_t map_base;
+
+static inline int __time_critical_func(sector_mapped)(uint32_t sector) {
+    return sector < MAP_SECTORS && psram_map[sector] && psram_map[sector] != MAP_LOST;
+}
 
-typedef void (*test_t)(uint8_t *dst);
+static int __time_critical_func(slot_alloc)(void) {
+    if (!slots_free)
+        return -1;
+    while (slot_used[slot_cursor] == UINT32_MAX)
+        slot_cursor = (slot_cursor + 1) % count_of(slot_used);
+    uint32_t bit = __builtin_ctz(~slot_used[slot_cursor]);
+    slot_used[slot_cursor] |= 1u << bit;
+    --slots_free;
+    return slot_cursor * 32 + bit;
+}
 
-static void prepare_test_0(uint8_t *dst) {
-    for (size_t i = 0; i < TEST_BLOCK_SIZE; ++i)
-        dst[i] = (i % 2 == 0) ? 0x55 : 0xAA;
+static inline void __time_critical_func(sector_unmap)(uint32_t sector) {
+    if (sector_mapped(sector)) {
+        uint32_t slot = psram_map[sector] - 1;
+        slot_used[slot / 32] &= ~(1u << (slot % 32));
+        ++slots_free;
+    }
+    /* a lost one just stops being lost */
+    if (sector < MAP_SECTORS)
+        psram_map[sector] = 0;
 }
 
-static void prepare_test_1(uint8_t *dst) {
-    for (size_t i = 0; i < TEST_BLOCK_SIZE; ++i)
-        dst[i] = (i % 2 == 0) ? 0xFF : 0x00;
+static inline int __time_critical_func(sector_map)(uint32_t sector) {
+    if (sector_mapped(sector))
+        return 1;
+    if (sector >= MAP_SECTORS)
+        return 0;
+    int slot = slot_alloc();
+    if (slot < 0)
+        return 0;
+    psram_map[sector] = slot + 1;
+    return 1;
 }
 
-static void prepare_test_2(uint8_t *dst) {
-    for (size_t i = 0; i < TEST_BLOCK_SIZE; ++i)
-        dst[i] = i % 256;
+static inline int __time_critical_func(sector_all_ff)(const uint8_t *buf) {
+    const uint32_t *words = (const uint32_t*)buf;
+    for (size_t i = 0; i < PSRAM_SECTOR_SIZE / 4; ++i)
+        if (words[i] != UINT32_MAX)
+            return 0;
+    return 1;
 }
 
-static void prepare_test_3(uint8_t *dst) {
-    uint32_t rng = 1;
+/* where the run of sectors that are mapped (or not) like the one at addr ends, at most at end */
+static uint32_t __time_critical_func(map_run_end)(uint32_t addr, uint32_t end) {
+    int mapped = sector_mapped(addr / PSRAM_SECTOR_SIZE);
+    uint32_t next = (addr / PSRAM_SECTOR_SIZE + 1) * PSRAM_SECTOR_SIZE;
+    while (next < end && sector_mapped(next / PSRAM_SECTOR_SIZE) == mapped)
+        next += PSRAM_SECTOR_SIZE;
+    return next < end ? next : end;
+}
+
+enum { OP_READ, OP_WRITE, OP_FILL };
+static void psram_bulk_run(int op, int raw, uint32_t addr, void *buf, uint8_t value, size_t sz);
+
+/* the tests use the bulk dma path on raw chip addresses, so they run at full speed and double as a benchmark */
+static uint8_t *test_buf = bigmem.ps2.bulk_buf;
+#define TEST_BUF_SIZE (sizeof(bigmem.ps2.bulk_buf))
+
+static uint32_t test_rng;
 
-    for (size_t i = 0; i < TEST_BLOCK_SIZE; ++i) {
-        rng = rng * 1103515245 + 12345;
-        dst[i] = rng % 256;
+static uint8_t test_rand(void) {
+    test_rng = test_rng * 1103515245 + 12345;
+    return test_rng >> 16;
+}
+
+static int test_check(uint32_t addr, const uint8_t *expected, const uint8_t *got, size_t sz, psram_test_result_t *res) {
+    for (size_t i = 0; i < sz; ++i) {
+        if (expected[i] != got[i]) {
+            res->fail_addr = addr + i;
+            res->expected = expected[i];
+            res->got = got[i];
+            return 0;
+        }
     }
+    return 1;
 }
 
-static test_t psram_tests[] = {
-    prepare_test_0,
-    prepare_test_1,
-    prepare_test_2,
-    prepare_test_3,
-};
+/* every data line on its own high and low, then a unique word at each address line so shorted
+   or stuck ones alias, then a random burst as long as the buffer allows to shake out timing */
+static int psram_test_quick(psram_test_result_t *res) {
+    uint8_t walk[64] __attribute__((aligned(4)));
+    uint8_t back[64] __attribute__((aligned(4)));
+    for (size_t i = 0; i < sizeof(walk) / 2; ++i) {
+        walk[i] = 1u << (i % 8);
+        walk[i + sizeof(walk) / 2] = ~walk[i];
+    }
+    psram_bulk_run(OP_WRITE, 1, 0, walk, 0, sizeof(walk));
+    psram_bulk_run(OP_READ, 1, 0, back, 0, sizeof(back));
+    res->bytes += 2 * sizeof(walk);
+    if (!test_check(0, walk, back, sizeof(walk), res))
+        return 0;
+
+    uint32_t word __attribute__((aligned(4)));
+    for (uint32_t bit = 0, addr = 0; addr < PSRAM_SIZE; addr = 4u << bit++) {
+        word = 0xA5000000 | addr;
+        psram_bulk_run(OP_WRITE, 1, addr, &word, 0, 4);
+    }
+    for (uint32_t bit = 0, addr = 0; addr < PSRAM_SIZE; addr = 4u << bit++) {
+        uint32_t expected = 0xA5000000 | addr;
+        psram_bulk_run(OP_READ, 1, addr, &word, 0, 4);
+        res->bytes += 8;
+        if (!test_check(addr, (uint8_t*)&expected, (uint8_t*)&word, 4, res))
+            return 0;
+    }
+
+    size_t half = TEST_BUF_SIZE / 2;
+    test_rng = 1;
+    for (size_t i = 0; i < half; ++i)
+        test_buf[i] = test_rand();
+    psram_bulk_run(OP_WRITE, 1, PSRAM_PAGE_SIZE, test_buf, 0, half);
+    psram_bulk_run(OP_READ, 1, PSRAM_PAGE_SIZE, test_buf + half, 0, half);
+    res->bytes += 2 * half;
+    return test_check(PSRAM_PAGE_SIZE, test_buf, test_buf + half, half, res);
+}
+
+/* the same but against a buffer that should hold nothing but expected */
+static int test_check_fill(uint32_t addr, uint8_t expected, const uint8_t *got, size_t sz, psram_test_result_t *res) {
+    for (size_t i = 0; i < sz; ++i) {
+        if (got[i] != expected) {
+            res->fail_addr = addr + i;
+            res->expected = expected;
+            res->got = got[i];
+            return 0;
+        }
+    }
+    return 1;
+}
 
-#define NUM_TESTS (sizeof(psram_tests)/sizeof(*psram_tests))
+/* one march element over the whole chip, a test_buf at a time: read the block and check for
+   'expect', then fill it with 'write' (either can be -1 for none). the next block isn't touched
+   before this one is done, so a write that disturbs a cell further along gets seen there. within
+   a block the reads all go before the fill, which is the price for running at bulk speed */
+static int march_element(int descending, int expect, int write, psram_test_result_t *res) {
+    const uint32_t blocks = PSRAM_SIZE / TEST_BUF_SIZE;
+
+    for (uint32_t i = 0; i < blocks; ++i) {
+        uint32_t addr = (descending ? blocks - 1 - i : i) * TEST_BUF_SIZE;
+        if (expect >= 0) {
+            psram_bulk_run(OP_READ, 1, addr, test_buf, 0, TEST_BUF_SIZE);
+            res->bytes += TEST_BUF_SIZE;
+            if (!test_check_fill(addr, expect, test_buf, TEST_BUF_SIZE, res))
+                return 0;
+        }
+        if (write >= 0) {
+            psram_bulk_run(OP_FILL, 1, addr, NULL, write, TEST_BUF_SIZE);
+            res->bytes += TEST_BUF_SIZE;
+        }
+    }
+    return 1;
+}
+
+/* March C- over the full chip a block at a time, with 0x55/0xAA as the two backgrounds:
+   up(w0) up(r0,w1) up(r1,w0) down(r0,w1) down(r1,w0) up(r0) */
+static int psram_test_thorough(psram_test_result_t *res) {
+    return march_element(0, -1, 0x55, res)
+        && march_element(0, 0x55, 0xAA, res)
+        && march_element(0, 0xAA, 0x55, res)
+        && march_element(1, 0x55, 0xAA, res)
+        && march_element(1, 0xAA, 0x55, res)
+        && march_element(0, 0x55, -1, res);
+}
 
-static void psram_run_tests(void) {
-    uint8_t cmd_write[4 + TEST_BLOCK_SIZE] = { 0x38 };
-    uint8_t cmd_read[4] = { 0xEB };
-    uint8_t buf[4 + TEST_BLOCK_SIZE] = { 0 };
+int psram_self_test(int mode, psram_test_result_t *res) {
+    memset(res, 0, sizeof(*res));
 
     uint64_t start = time_us_64();
+    res->ok = (mode == PSRAM_TEST_THOROUGH) ? psram_test_thorough(res) : psram_test_quick(res);
+    res->us = time_us_64() - start;
 
-    for (size_t test = 0; test < NUM_TESTS; ++test) {
-        printf("Start PSRAM test %d\n", test);
-        psram_tests[test](cmd_write+4);
+    /* the tests go straight to the chip, whatever the slots held is gone */
+    psram_forget_all();
 
-        uint32_t addr = 0;
-        for (size_t i = 0; i < TEST_CYCLES; ++i) {
-            memset(buf, 0, sizeof(buf));
+    if (!res->ok)
+        printf("PSRAM test failed at 0x%06X: expected %02X got %02X\n", (unsigned)res->fail_addr, res->expected, res->got);
+    return res->ok;
+}
+
+static bool psram_run_tests(void) {
+    psram_test_result_t res;
+    return psram_self_test(PSRAM_TEST_QUICK, &res);
+}
+
+/* clkdiv is in quarters; sample delay 0 bypasses the input synchronizer, 1 goes through it
+   which moves the sampling point 2 system clocks earlier relative to the data */
+static void psram_set_timing(int clkdiv, int sample_delay) {
+    uint dat_mask = 0xFu << PSRAM_DAT;
+
+    pio_sm_set_clkdiv(spi.pio, spi.sm, clkdiv / 4.0f);
+
+    /* a SCK period is 4 PIO cycles, so SCK is clk_sys / clkdiv in quarters; the command, address
+       and wait cycles come off the top and each byte takes two clocks */
+    uint32_t sck_khz = clock_get_hz(clk_sys) / 1000 / clkdiv;
+    uint32_t clocks = PSRAM_TCEM_NS * sck_khz / 1000000;
+    burst_max = ((clocks - 8 - PSRAM_READ_WAIT) / 2) & ~3u;
+
+    if (sample_delay)
+        hw_clear_bits(&spi.pio->input_sync_bypass, dat_mask);
+    else
+        hw_set_bits(&spi.pio->input_sync_bypass, dat_mask);
+    pio_sm_clkdiv_restart(spi.pio, spi.sm);
+}
+
+#define CAL_CLKDIV_MIN (PSRAM_CLKDIV_MIN * 4)
+#define CAL_CLKDIV_MAX (PSRAM_CLKDIV * 4)
+#define CAL_SAMPLE_DELAYS 2
+
+/* sweeps the clock divider in quarter steps and both sample delays, then takes the fastest
+   setting whose next slower neighbour passes too - a setting right at the edge is not kept */
+static void psram_calibrate(void) {
+    bool pass[CAL_CLKDIV_MAX - CAL_CLKDIV_MIN + 1][CAL_SAMPLE_DELAYS];
+
+    for (int clkdiv = CAL_CLKDIV_MIN; clkdiv <= CAL_CLKDIV_MAX; ++clkdiv) {
+        for (int delay = 0; delay < CAL_SAMPLE_DELAYS; ++delay) {
+            psram_set_timing(clkdiv, delay);
+            pass[clkdiv - CAL_CLKDIV_MIN][delay] = psram_run_tests();
+            printf("PSRAM clkdiv %d.%02d delay %d: %s\n", clkdiv / 4, (clkdiv % 4) * 25, delay,
+                pass[clkdiv - CAL_CLKDIV_MIN][delay] ? "pass" : "fail");
+        }
+    }
+
+    for (int clkdiv = CAL_CLKDIV_MIN; clkdiv <= CAL_CLKDIV_MAX; ++clkdiv) {
+        for (int delay = 0; delay < CAL_SAMPLE_DELAYS; ++delay) {
+            int i = clkdiv - CAL_CLKDIV_MIN;
+            /* the slowest setting has nothing slower to check against */
+            if (pass[i][delay] && (clkdiv == CAL_CLKDIV_MAX || pass[i + 1][delay])) {
+                psram_set_timing(clkdiv, delay);
+                settings_set_psram_timing(clkdiv, delay);
+                return;
+            }
+        }
+    }
 
-            cmd_write[1] = cmd_read[1] = (addr & 0xFF0000) >> 16;
-            cmd_write[2] = cmd_read[2] = (addr & 0xFF00) >> 8;
-            cmd_write[3] = cmd_read[3] = (addr & 0xFF);
+    fatal("PSRAM failed test at every clock setting");
+}
 
-            SPI_OP(pio_qspi_write8_read8_blocking(&spi, cmd_write, sizeof(cmd_write), NULL, 0));
-            SPI_OP(pio_qspi_write8_read8_blocking(&spi, cmd_read, sizeof(cmd_read), buf, sizeof(buf)));
+/*
+ * Both cores queue their transfers here instead of taking turns on a lock. The memory card
+ * protocol on core1 gets a queue that always goes first, the background work of core0 gets the
+ * other one. Everything moves in bursts of at most burst_max bytes and the next burst is picked
+ * from the DMA irq, so a background transfer is pre-empted after its current burst and the
+ * longest core1 waits behind core0 is one burst - tCEM plus the irq.
+ *
+ * Within a queue requests run in order. Slots are handed out and taken back as the bursts get
+ * to each sector, so the map always matches what the chip has been through. Raw requests skip
+ * the map and address the chip directly, that's for the self-test only.
+ */
+
+enum { PRIO_PROTOCOL, PRIO_BACKGROUND, NUM_PRIO };
+
+#define PSRAM_QUEUE_LEN 4
+
+typedef void (*psram_cb_t)(void);
+
+typedef struct {
+    uint8_t op;
+    uint8_t value;
+    uint8_t raw;
+    uint32_t addr, end;
+    uint8_t *buf;
+    psram_cb_t done_cb;
+} psram_req_t;
+
+typedef struct {
+    psram_req_t req[PSRAM_QUEUE_LEN];
+    uint8_t head, count;
+} psram_queue_t;
+
+static psram_queue_t queues[NUM_PRIO];
+/* guards the queues and the bus, never held across a burst */
+static spin_lock_t *sched_lock;
+/* the queue whose head has a burst on the bus, NULL while idle */
+static psram_queue_t *volatile inflight;
+static uint8_t burst_cmd[4];
+
+/* callbacks of finished requests, they run once the lock is dropped */
+typedef struct {
+    psram_cb_t cb[NUM_PRIO * PSRAM_QUEUE_LEN];
+    int count;
+} psram_done_t;
+
+static void __time_critical_func(psram_burst_done)(void);
+
+static inline void __time_critical_func(queue_pop)(psram_queue_t *q, psram_done_t *done) {
+    done->cb[done->count++] = q->req[q->head].done_cb;
+    q->head = (q->head + 1) % PSRAM_QUEUE_LEN;
+    --q->count;
+}
 
-            if (memcmp(cmd_write+4, buf+4, TEST_BLOCK_SIZE) != 0) {
-                printf("test %d cycle %d\n", test, i);
-                fatal("PSRAM failed test");
+/* expects sched_lock to be held; works out where the next burst of req goes in the chip and how
+   long it is, or returns 0 if the current sector got dealt with without the bus */
+static int __time_critical_func(sched_place)(psram_req_t *req, uint32_t *phys, uint32_t *len) {
+    uint32_t addr = req->addr;
+    uint32_t left = req->end - addr;
+
+    if (req->raw) {
+        *phys = addr;
+        *len = PSRAM_PAGE_SIZE - (addr % PSRAM_PAGE_SIZE);
+    } else {
+        uint32_t sector = addr / PSRAM_SECTOR_SIZE;
+        uint32_t offset = addr % PSRAM_SECTOR_SIZE;
+
+        if (req->op == OP_READ) {
+            /* sectors without a slot read as 0xFF, psram_submit already put that in the buffer */
+            if (!sector_mapped(sector)) {
+                uint32_t next = map_run_end(addr, req->end);
+                req->buf += next - addr;
+                req->addr = next;
+                return 0;
             }
+        } else if (offset == 0 && left >= PSRAM_SECTOR_SIZE
+                   && (req->op == OP_FILL ? req->value == 0xFF : sector_all_ff(req->buf))) {
+            /* erasing is just forgetting */
+            sector_unmap(sector);
+        } else if (!sector_map(sector)) {
+            ++sectors_dropped;
+            if (sector < MAP_SECTORS)
+                psram_map[sector] = MAP_LOST;
+        }
 
-            addr += TEST_BLOCK_SIZE;
+        if (req->op != OP_READ && !sector_mapped(sector)) {
+            uint32_t skip = PSRAM_SECTOR_SIZE - offset;
+            if (skip > left)
+                skip = left;
+            if (req->op == OP_WRITE)
+                req->buf += skip;
+            req->addr += skip;
+            return 0;
         }
+
+        /* a slot never crosses a page */
+        *phys = (psram_map[sector] - 1) * PSRAM_SECTOR_SIZE + offset;
+        *len = PSRAM_SECTOR_SIZE - offset;
     }
 
-    uint64_t end = time_us_64();
-    printf("PSRAM passed all tests -- took %.2f ms -- avg speed %.2f kB/s\n",
-        (end - start) / 1000.0,
-        1000000.0 * (NUM_TESTS * TEST_CYCLES * TEST_BLOCK_SIZE * 2) / (end - start) / 1024);
+    if (*len > burst_max)
+        *len = burst_max;
+    if (*len > left)
+        *len = left;
+    return 1;
+}
+
+/* expects sched_lock to be held, puts the next burst on the bus if it's free */
+static void __time_critical_func(sched_next)(psram_done_t *done) {
+    while (!inflight) {
+        psram_queue_t *q = NULL;
+        for (int prio = 0; prio < NUM_PRIO && !q; ++prio)
+            if (queues[prio].count)
+                q = &queues[prio];
+        if (!q)
+            return;
+
+        psram_req_t *req = &q->req[q->head];
+        uint32_t addr, len;
+        if (req->addr == req->end) {
+            queue_pop(q, done);
+            continue;
+        }
+        if (!sched_place(req, &addr, &len))
+            continue;
+        req->addr += len;
+
+        inflight = q;
+        burst_cmd[0] = (req->op == OP_READ) ? 0xEB : 0x38;
+        burst_cmd[1] = (addr & 0xFF0000) >> 16;
+        burst_cmd[2] = (addr & 0xFF00) >> 8;
+        burst_cmd[3] = (addr & 0xFF);
+        gpio_put(spi.cs_pin, 0);
+        if (req->op == OP_READ) {
+            pio_qspi_write8_read8_dma(&spi, burst_cmd, sizeof(burst_cmd), PSRAM_READ_WAIT, req->buf, len, psram_burst_done);
+            req->buf += len;
+        } else if (req->op == OP_WRITE) {
+            pio_qspi_write8_write_dma(&spi, burst_cmd, sizeof(burst_cmd), req->buf, len, psram_burst_done);
+            req->buf += len;
+        } else {
+            pio_qspi_write8_fill_dma(&spi, burst_cmd, sizeof(burst_cmd), req->value, len, psram_burst_done);
+        }
+    }
+}
+
+static inline void __time_critical_func(run_done)(psram_done_t *done) {
+    for (int i = 0; i < done->count; ++i)
+        if (done->cb[i])
+            done->cb[i]();
+}
+
+/* called from the DMA irq on core0 once a burst is through */
+static void __time_critical_func(psram_burst_done)(void) {
+    psram_done_t done = { .count = 0 };
+
+    uint32_t save = spin_lock_blocking(sched_lock);
+    psram_queue_t *q = inflight;
+    inflight = NULL;
+    if (q->req[q->head].addr == q->req[q->head].end)
+        queue_pop(q, &done);
+    sched_next(&done);
+    spin_unlock(sched_lock, save);
+
+    run_done(&done);
+}
+
+static void __time_critical_func(psram_submit)(int prio, int op, int raw, uint32_t addr, void *buf, uint8_t value, size_t sz,
+                                               psram_cb_t done_cb) {
+    psram_done_t done = { .count = 0 };
+    psram_queue_t *q = &queues[prio];
+    uint32_t save;
+
+    /* whatever isn't mapped stays 0xFF - filled here by the caller so the scheduler never does
+       more than a lookup with the lock held, the bursts overwrite the rest */
+    if (op == OP_READ && !raw)
+        memset(buf, 0xFF, sz);
+
+    /* a full queue drains from the irq, so it's fine to spin here */
+    while (1) {
+        save = spin_lock_blocking(sched_lock);
+        if (q->count < PSRAM_QUEUE_LEN)
+            break;
+        spin_unlock(sched_lock, save);
+    }
+
+    psram_req_t *req = &q->req[(q->head + q->count) % PSRAM_QUEUE_LEN];
+    req->op = op;
+    req->value = value;
+    req->raw = raw;
+    if (!raw)
+        addr += map_base;
+    req->addr = addr;
+    req->end = addr + sz;
+    req->buf = buf;
+    req->done_cb = done_cb;
+    ++q->count;
+
+    sched_next(&done);
+    spin_unlock(sched_lock, save);
+
+    run_done(&done);
+}
+
+int __time_critical_func(psram_idle)(void) {
+    return !inflight && !queues[PRIO_PROTOCOL].count && !queues[PRIO_BACKGROUND].count;
+}
+
+void __time_critical_func(psram_read_dma)(uint32_t addr, void *vbuf, size_t sz, void (*done_cb)(void)) {
+    /* the data goes after the 4-byte prefix, which keeps it word aligned for the dma */
+    psram_submit(PRIO_PROTOCOL, OP_READ, 0, addr, (uint8_t*)vbuf + 4, 0, sz - 4, done_cb);
+}
+
+void __time_critical_func(psram_write_dma)(uint32_t addr, void *buf, size_t sz, void (*done_cb)(void)) {
+    psram_submit(PRIO_PROTOCOL, OP_WRITE, 0, addr, buf, 0, sz, done_cb);
+}
+
+void __time_critical_func(psram_fill_dma)(uint32_t addr, uint8_t value, size_t sz, void (*done_cb)(void)) {
+    psram_submit(PRIO_PROTOCOL, OP_FILL, 0, addr, NULL, value, sz, done_cb);
+}
+
+static volatile int bulk_busy;
+
+static void psram_bulk_done(void) {
+    bulk_busy = 0;
+}
+
+/* core0 only - one request at a time, and this waits for it */
+static void psram_run_wait(int prio, int op, int raw, uint32_t addr, void *buf, uint8_t value, size_t sz) {
+    if (sz == 0)
+        return;
+
+    bulk_busy = 1;
+    psram_submit(prio, op, raw, addr, buf, value, sz, psram_bulk_done);
+    while (bulk_busy)
+        tight_loop_contents();
+}
+
+static void psram_bulk_run(int op, int raw, uint32_t addr, void *buf, uint8_t value, size_t sz) {
+    psram_run_wait(PRIO_BACKGROUND, op, raw, addr, buf, value, sz);
+}
+
+void psram_read_bulk(uint32_t addr, void *buf, size_t sz) {
+    psram_bulk_run(OP_READ, 0, addr, buf, 0, sz);
+}
+
+void psram_write_bulk(uint32_t addr, void *buf, size_t sz) {
+    psram_bulk_run(OP_WRITE, 0, addr, buf, 0, sz);
+}
+
+void psram_fill_bulk(uint32_t addr, uint8_t value, size_t sz) {
+    psram_bulk_run(OP_FILL, 0, addr, NULL, value, sz);
+}
+
+void psram_forget_all(void) {
+    uint32_t save = spin_lock_blocking(sched_lock);
+    memset(psram_map, 0, sizeof(psram_map));
+    memset(slot_used, 0, sizeof(slot_used));
+    slot_cursor = 0;
+    slots_free = PSRAM_SLOTS;
+    spin_unlock(sched_lock, save);
+}
+
+void psram_forget(uint32_t base, uint32_t sz) {
+    uint32_t save = spin_lock_blocking(sched_lock);
+    for (uint32_t sector = base / PSRAM_SECTOR_SIZE; sector < (base + sz) / PSRAM_SECTOR_SIZE; ++sector)
+        sector_unmap(sector);
+    spin_unlock(sched_lock, save);
+}
+
+void psram_set_base(uint32_t base) {
+    map_base = base;
+}
+
+uint32_t psram_get_free_bytes(void) {
+    return slots_free * PSRAM_SECTOR_SIZE;
 }
 
-void psram_read(uint32_t addr, void *vbuf, size_t sz) {
-    uint8_t *buf = vbuf;
-    uint8_t cmd_read[4] = { 0xEB, (addr & 0xFF0000) >> 16, (addr & 0xFF00) >> 8, (addr & 0xFF) };
-    uint8_t tmpbuf[4 + 512];
-    SPI_OP(pio_qspi_write8_read8_blocking(&spi, cmd_read, sizeof(cmd_read), tmpbuf, sizeof(tmpbuf)));
-    memcpy(buf, tmpbuf+4, sz);
+uint32_t psram_get_dropped_sectors(void) {
+    return sectors_dropped;
 }
 
-void __time_critical_func(psram_read_dma)(uint32_t addr, void *vbuf, size_t sz) {
-    uint8_t *buf = vbuf;
-    uint8_t cmd_read[4] = { 0xEB, (addr & 0xFF0000) >> 16, (addr & 0xFF00) >> 8, (addr & 0xFF) };
-    gpio_put(spi.cs_pin, 0);
-    pio_qspi_write8_read8_dma(&spi, cmd_read, sizeof(cmd_read), buf, sz);
+void psram_clear_dropped(void) {
+    sectors_dropped = 0;
 }
 
-void __time_critical_func(psram_write)(uint32_t addr, void *vbuf, size_t sz) {
-    uint8_t *buf = vbuf;
-    uint8_t cmd_write[4 + 512];
-    cmd_write[0] = 0x38;
-    cmd_write[1] = (addr & 0xFF0000) >> 16;
-    cmd_write[2] = (addr & 0xFF00) >> 8;
-    cmd_write[3] = (addr & 0xFF);
-    memcpy(cmd_write + 4, buf, sz);
-    SPI_OP(pio_qspi_write8_read8_blocking(&spi, cmd_write, 4 + sz, NULL, 0));
+int psram_sector_lost(uint32_t addr) {
+    uint32_t sector = (map_base + addr) / PSRAM_SECTOR_SIZE;
+    return sector < MAP_SECTORS && psram_map[sector] == MAP_LOST;
+}
+
+static const char *bench_names[PSRAM_BENCH_NUM] = {
+    [PSRAM_BENCH_READ_BULK] = "read bulk",
+    [PSRAM_BENCH_WRITE_BULK] = "write bulk",
+    [PSRAM_BENCH_FILL_BULK] = "fill bulk",
+    [PSRAM_BENCH_READ_DMA] = "read dma",
+    [PSRAM_BENCH_WRITE_DMA] = "write dma",
+};
+
+/* every path on raw chip addresses, 4 bytes up to 64 KB in steps of 4x. reads and writes stop at
+   the size of the test buffer, fills don't need one */
+int psram_benchmark(psram_bench_result_t *res, int max) {
+    int num = 0;
+
+    printf("PSRAM benchmark, clkdiv %d.%02d\n", settings_get_psram_clkdiv() / 4, settings_get_psram_clkdiv() % 4 * 25);
+    for (int kind = 0; kind < PSRAM_BENCH_NUM; ++kind) {
+        int prio = (kind == PSRAM_BENCH_READ_DMA || kind == PSRAM_BENCH_WRITE_DMA) ? PRIO_PROTOCOL : PRIO_BACKGROUND;
+        int op = (kind == PSRAM_BENCH_READ_BULK || kind == PSRAM_BENCH_READ_DMA) ? OP_READ
+               : (kind == PSRAM_BENCH_FILL_BULK) ? OP_FILL : OP_WRITE;
+
+        for (uint32_t size = 4; size <= PSRAM_BENCH_MAX_SIZE && num < max; size *= 4) {
+            if (op != OP_FILL && size > TEST_BUF_SIZE)
+                break;
+
+            /* enough rounds to get past the timer resolution, spread over the chip */
+            uint32_t count = (256 * 1024) / size;
+            if (count < 8)
+                count = 8;
+
+            uint64_t start = time_us_64();
+            for (uint32_t i = 0; i < count; ++i)
+                psram_run_wait(prio, op, 1, (i * size) % PSRAM_SIZE, test_buf, 0xA5, size);
+            uint64_t us = time_us_64() - start;
+
+            psram_bench_result_t *r = &res[num++];
+            r->kind = kind;
+            r->size = size;
+            r->count = count;
+            r->us = us ? us : 1;
+            printf("%-10s %6u B: %6.2f MB/s, %8.2f us each\n", bench_names[kind], (unsigned)size,
+                (double)size * count / r->us, (double)r->us / count);
+        }
+    }
+
+    /* same as the self-test, the contents are gone */
+    psram_forget_all();
+    return num;
 }
 
 void psram_init(void) {
     uint32_t offset;
 
+    sched_lock = spin_lock_init(spin_lock_claim_unused(1));
+
     gpio_init(spi.cs_pin);
     gpio_put(spi.cs_pin, 1);
     gpio_set_dir(spi.cs_pin, GPIO_OUT);
@@ -150,16 +670,27 @@ void psram_init(void) {
 
     pio_remove_program(spi.pio, &spi_cpha0_program, offset);
     offset = pio_add_program(spi.pio, &qspi_cpha0_program);
-    pio_qspi_init(spi.pio, spi.sm, offset, 8, PSRAM_CLKDIV, 0, 0, PSRAM_CLK, PSRAM_DAT);
+    pio_qspi_init(spi.pio, spi.sm, offset, 32, PSRAM_CLKDIV, 0, 0, PSRAM_CLK, PSRAM_DAT);
     pio_qspi_dma_init(&spi);
 
-    /* validate PSRAM is working properly */
-    psram_run_tests();
-
-    /* and erase everything to 0xFF */
-    uint8_t erasebuf[512];
-    memset(erasebuf, 0xFF, sizeof(erasebuf));
-    for (int i = 0; i < 8 * 1024 * 1024; i += 512) {
-        psram_write(i, erasebuf, sizeof(erasebuf));
+    /* validate PSRAM is working properly at the stored timing, or find a new one */
+    uint64_t start = time_us_64();
+    int clkdiv = settings_get_psram_clkdiv();
+    int delay = settings_get_psram_sample_delay();
+    bool ok = false;
+    if (clkdiv >= CAL_CLKDIV_MIN && clkdiv <= CAL_CLKDIV_MAX && delay < CAL_SAMPLE_DELAYS) {
+        psram_set_timing(clkdiv, delay);
+        ok = psram_run_tests();
+        if (!ok)
+            printf("PSRAM failed at the stored timing, recalibrating\n");
     }
+    if (!ok)
+        psram_calibrate();
+    uint64_t end = time_us_64();
+
+    clkdiv = settings_get_psram_clkdiv();
+    printf("PSRAM passed all tests -- clkdiv %d.%02d delay %d -- took %.2f ms\n",
+        clkdiv / 4, (clkdiv % 4) * 25, settings_get_psram_sample_delay(), (end - start) / 1000.0);
+
+    /* nothing has to be erased, all sectors start out as not valid and read back as 0xFF */
 }
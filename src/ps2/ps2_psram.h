@@ -4,6 +4,74 @@
 #include <stddef.h>
 
 void psram_init(void);
-void psram_read(uint32_t addr, void *buf, size_t sz);
-void psram_write(uint32_t addr, void *buf, size_t sz);
-void psram_read_dma(uint32_t addr, void *buf, size_t sz);
+/* addresses are card offsets of up to 16 MB, the sectors are placed in the chip as they get written
+   and the ones that are all 0xFF don't take any room. any length, split into bursts that stay
+   within a sector and within tCEM; buf has to be word aligned, addr and sz multiples of 4 and
+   writes should cover whole sectors */
+
+/* background transfers, they give way to the ones below between bursts and wait until done - core0 only */
+void psram_read_bulk(uint32_t addr, void *buf, size_t sz);
+void psram_write_bulk(uint32_t addr, void *buf, size_t sz);
+void psram_fill_bulk(uint32_t addr, uint8_t value, size_t sz);
+
+/* memory card protocol transfers, these go ahead of everything else and return right away.
+   done_cb runs from the DMA irq on core0, or straight away if the chip didn't have to be touched */
+/* the data lands after a 4-byte prefix of buf, sz counts the prefix */
+void psram_read_dma(uint32_t addr, void *buf, size_t sz, void (*done_cb)(void));
+void psram_write_dma(uint32_t addr, void *buf, size_t sz, void (*done_cb)(void));
+void psram_fill_dma(uint32_t addr, uint8_t value, size_t sz, void (*done_cb)(void));
+/* nothing queued or on the bus */
+int psram_idle(void);
+/* drops every slot, all of the card reads as 0xFF afterwards. nothing may be queued */
+void psram_forget_all(void);
+/* same for the sz bytes of the map at base, that's where a card that got pushed out was */
+void psram_forget(uint32_t base, uint32_t sz);
+/* the map holds 16 MB of cards; addresses passed in from here on are offsets into the card at
+   base. nothing may be queued */
+void psram_set_base(uint32_t base);
+/* room left in the chip for sectors that aren't all 0xFF */
+uint32_t psram_get_free_bytes(void);
+/* sectors whose writes were thrown away because the chip was full */
+uint32_t psram_get_dropped_sectors(void);
+void psram_clear_dropped(void);
+/* the last write to the sector at addr got dropped - it reads as 0xFF, which isn't what the card
+   holds, so it must not be flushed. stays so until the sector is written or erased again */
+int psram_sector_lost(uint32_t addr);
+
+enum {
+    PSRAM_TEST_QUICK,    /* data lines, address lines and one long burst - a few ms, runs on boot */
+    PSRAM_TEST_THOROUGH, /* march test over the full chip in bulk blocks - a few seconds, wipes everything */
+};
+
+typedef struct {
+    int ok;
+    uint32_t fail_addr;
+    uint8_t expected, got;
+    uint32_t us;    /* time taken */
+    uint32_t bytes; /* moved over the bus, for throughput */
+} psram_test_result_t;
+
+/* the test goes to the chip directly - all of the card reads as 0xFF afterwards, so it has to be reopened */
+int psram_self_test(int mode, psram_test_result_t *res);
+
+enum {
+    PSRAM_BENCH_READ_BULK,
+    PSRAM_BENCH_WRITE_BULK,
+    PSRAM_BENCH_FILL_BULK,
+    PSRAM_BENCH_READ_DMA,  /* through the memory card protocol queue */
+    PSRAM_BENCH_WRITE_DMA,
+    PSRAM_BENCH_NUM
+};
+
+#define PSRAM_BENCH_MAX_SIZE (64 * 1024)
+
+typedef struct {
+    uint8_t kind;
+    uint32_t size;  /* bytes per transaction */
+    uint32_t count; /* transactions timed */
+    uint32_t us;    /* for all of them, MB/s is size * count / us */
+} psram_bench_result_t;
+
+/* times each transfer path over a range of sizes, prints a table and fills up to max results.
+   wipes psram like the self-test does */
+int psram_benchmark(psram_bench_result_t *res, int max);
@@ -16,15 +16,18 @@ typedef struct {
     uint8_t ps2_channel;
     uint8_t ps1_flags; // TODO: single bit options: freepsxboot, pocketstation, freepsxboot slot
     // TODO: more ps1 settings: model for freepsxboot
-    uint8_t ps2_flags; // TODO: single bit options: autoboot
+    uint8_t ps2_flags; // single bit options, see SETTINGS_FLAGS_AUTOBOOT and SETTINGS_FLAGS_JOURNAL
     uint8_t sys_flags; // TODO: single bit options: whether ps1 or ps2 mode, etc
-    uint8_t unused[3];
+    uint8_t psram_clkdiv; // PSRAM clock divider in quarters as found by calibration, 0 until calibrated
+    uint8_t psram_sample_delay;
+    uint8_t unused[1];
     // TODO: display settings?
     // TODO: how do we store last used channel for cards that use autodetecting w/ gameid?
 } settings_t;
 
 #define SETTINGS_VERSION_MAGIC (0xABCD0002)
 #define SETTINGS_FLAGS_AUTOBOOT (0b1)
+#define SETTINGS_FLAGS_JOURNAL  (0b10)
 
 _Static_assert(sizeof(settings_t) == 16, "unexpected padding in the settings structure");
 
@@ -141,3 +144,32 @@ void settings_set_ps2_autoboot(bool autoboot) {
         settings.ps2_flags ^= SETTINGS_FLAGS_AUTOBOOT;
     SETTINGS_UPDATE_FIELD(ps2_flags);
 }
+
+bool settings_get_ps2_journal(void) {
+    return (settings.ps2_flags & SETTINGS_FLAGS_JOURNAL);
+}
+
+void settings_set_ps2_journal(bool journal) {
+    if (journal != settings_get_ps2_journal())
+        settings.ps2_flags ^= SETTINGS_FLAGS_JOURNAL;
+    SETTINGS_UPDATE_FIELD(ps2_flags);
+}
+
+int settings_get_psram_clkdiv(void) {
+    return settings.psram_clkdiv;
+}
+
+int settings_get_psram_sample_delay(void) {
+    return settings.psram_sample_delay;
+}
+
+void settings_set_psram_timing(int clkdiv, int sample_delay) {
+    if (clkdiv != settings.psram_clkdiv) {
+        settings.psram_clkdiv = clkdiv;
+        SETTINGS_UPDATE_FIELD(psram_clkdiv);
+    }
+    if (sample_delay != settings.psram_sample_delay) {
+        settings.psram_sample_delay = sample_delay;
+        SETTINGS_UPDATE_FIELD(psram_sample_delay);
+    }
+}
@@ -23,6 +23,13 @@ int settings_get_mode(void);
 void settings_set_mode(int mode);
 bool settings_get_ps2_autoboot(void);
 void settings_set_ps2_autoboot(bool autoboot);
+/* flush card writes through a journal so power loss can't leave a half-written card */
+bool settings_get_ps2_journal(void);
+void settings_set_ps2_journal(bool journal);
+/* clkdiv is in quarters, 0 means PSRAM timing hasn't been calibrated yet */
+int settings_get_psram_clkdiv(void);
+int settings_get_psram_sample_delay(void);
+void settings_set_psram_timing(int clkdiv, int sample_delay);
 
 #define IDX_MIN 1
 #define IDX_BOOT 0